@@ -57,6 +57,19 @@
 #include <linux/wait.h>
 #include <linux/leds.h>
 #include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/random.h>
+#include <linux/completion.h>
+#include <linux/miscdevice.h>
+#include <linux/vmalloc.h>
+#include <linux/poll.h>
+#include <linux/mm.h>
+#include <linux/ctype.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/sched/types.h>
 #include <linux/input.h>
 #include <linux/input/mt.h>
 #include <linux/input-polldev.h>
@@ -71,6 +84,29 @@
 #include <linux/notifier.h>
 #endif
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 16, 0)
+typedef unsigned int __poll_t;
+#define EPOLLIN		POLLIN
+#define EPOLLRDNORM	POLLRDNORM
+#define EPOLLOUT	POLLOUT
+#define EPOLLWRNORM	POLLWRNORM
+#define EPOLLHUP	POLLHUP
+
+#define DEFINE_SHOW_ATTRIBUTE(__name)					\
+static int __name ## _open(struct inode *inode, struct file *file)	\
+{									\
+	return single_open(file, __name ## _show, inode->i_private);	\
+}									\
+									\
+static const struct file_operations __name ## _fops = {			\
+	.owner		= THIS_MODULE,					\
+	.open		= __name ## _open,				\
+	.read		= seq_read,					\
+	.llseek		= seq_lseek,					\
+	.release	= single_release,				\
+}
+#endif
+
 #define APPLESPI_PACKET_SIZE	256
 #define APPLESPI_STATUS_SIZE	4
 
@@ -78,19 +114,38 @@
 #define PACKET_TYPE_WRITE	0x40
 #define PACKET_DEV_KEYB		0x01
 #define PACKET_DEV_TPAD		0x02
+#define PACKET_DEV_INFO		0xd0
 
 #define MAX_ROLLOVER		6
 #define MAX_MODIFIERS		8
+#define MAX_SCANCODES		256
+#define MAX_FN_CODES		32
+#define MAX_ISO_CODES		8
 
 #define MAX_FINGERS		11
 #define MAX_FINGER_ORIENTATION	16384
+#define MAX_FINGER_PRESSURE	1023
+#define FORCE_CLICK_HYST	4	/* release at 3/4 of the threshold */
 #define MAX_PKTS_PER_MSG	2
+#define TP_TRACK_MAX_DIST	800	/* max distance moved per frame */
+#define TP_PALM_SIZE		800	/* default palm_size */
+#define TP_TRACK_BENCH_ITERS	1000
+#define TP_SCROLL_DIST		500	/* movement per wheel detent */
+#define WHEEL_DETENT		120	/* high-resolution units per detent */
+#define TP_REL_DIV		8	/* touchpad units per pointer unit */
+#define TP_REL_ACCEL_SPEED	100	/* speed at which tp_rel_accel applies */
+#define TP_DECODE_BENCH_ITERS	10000
+#define TP_RING_SIZE		16	/* must be a power of 2 */
+#define TP_FRAME_MAX_LEN	(sizeof(struct touchpad_protocol) + \
+				 MAX_FINGERS * sizeof(struct tp_finger))
 
 #define MIN_KBD_BL_LEVEL	32
 #define MAX_KBD_BL_LEVEL	255
 #define KBD_BL_LEVEL_SCALE	1000000
 #define KBD_BL_LEVEL_ADJ	\
 	((MAX_KBD_BL_LEVEL - MIN_KBD_BL_LEVEL) * KBD_BL_LEVEL_SCALE / 255)
+#define MIN_KBD_BL_FADE_STEP	10	/* in ms */
+#define MAX_KBD_BL_FADE_TIME	60000	/* in ms */
 
 #define DBG_CMD_TP_INI		BIT(0)
 #define DBG_CMD_BL		BIT(1)
@@ -118,12 +173,49 @@
 
 #define SPI_RW_CHG_DLY		100	/* from experimentation, in us */
 
+#define MAX_CMD_RETRIES		3
+#define MAX_CMD_PAYLOAD		16
+#define CMD_BUILD_BENCH_ITERS	10000
+#define CMD_LAT_BUCKETS		20	/* log2 buckets, in us */
+#define CMD_SYNC_TIMEOUT	1000	/* in ms */
+#define TP_INFO_TIMEOUT		1000	/* in ms */
+#define DRAIN_TIMEOUT		2000	/* in ms */
+#define KEYMAP_BENCH_ITERS	10000
+#define KBD_FUZZ_FRAMES		100000
+#define KBD_FUZZ_MAX_HELD	10
+
+#define RAW_RING_VERSION	1
+#define RAW_RING_RECORDS	1024
+#define RAW_DIR_RX		0
+#define RAW_DIR_TX		1
+
+/* bumped whenever a parameter affecting the keymaps changes */
+static unsigned int applespi_keymap_gen;
+
+static int applespi_set_keymap_param(const char *val,
+				     const struct kernel_param *kp)
+{
+	int sts;
+
+	sts = param_set_uint(val, kp);
+	if (!sts)
+		WRITE_ONCE(applespi_keymap_gen, applespi_keymap_gen + 1);
+
+	return sts;
+}
+
+/* the keymaps depend on these, so they are rebuilt whenever these change */
+static const struct kernel_param_ops applespi_keymap_param_ops = {
+	.set	= applespi_set_keymap_param,
+	.get	= param_get_uint,
+};
+
 static unsigned int fnmode = 1;
-module_param(fnmode, uint, 0644);
+module_param_cb(fnmode, &applespi_keymap_param_ops, &fnmode, 0644);
 MODULE_PARM_DESC(fnmode, "Mode of fn key on Apple keyboards (0 = disabled, [1] = fkeyslast, 2 = fkeysfirst)");
 
 static unsigned int iso_layout;
-module_param(iso_layout, uint, 0644);
+module_param_cb(iso_layout, &applespi_keymap_param_ops, &iso_layout, 0644);
 MODULE_PARM_DESC(iso_layout, "Enable/Disable hardcoded ISO-layout of the keyboard. ([0] = disabled, 1 = enabled)");
 
 static unsigned int debug;
@@ -134,6 +226,70 @@ static int touchpad_dimensions[4];
 module_param_array(touchpad_dimensions, int, NULL, 0444);
 MODULE_PARM_DESC(touchpad_dimensions, "The pixel dimensions of the touchpad, as x_min,x_max,y_min,y_max .");
 
+static unsigned int watchdog_timeout = 1000;
+module_param(watchdog_timeout, uint, 0644);
+MODULE_PARM_DESC(watchdog_timeout, "Time in ms after which an outstanding read or write is considered lost and the driver recovers (0 = disabled, [1000]).");
+
+static unsigned int interactive_latency = 10;
+module_param(interactive_latency, uint, 0644);
+MODULE_PARM_DESC(interactive_latency, "Latency target in ms for interactive commands such as the caps-lock led; backlight updates are held back for up to this long after caps-lock is pressed ([10]).");
+
+static unsigned int tp_tracking;
+module_param(tp_tracking, uint, 0644);
+MODULE_PARM_DESC(tp_tracking, "How touchpad contacts are tracked across frames ([0] = by position, 1 = by the order the touchpad reports them in, falling back to by position when that isn't consistent).");
+
+static unsigned int palm_rejection;
+module_param(palm_rejection, uint, 0644);
+MODULE_PARM_DESC(palm_rejection, "Drop touchpad contacts that look like palms instead of reporting them ([0] = disabled, 1 = enabled).");
+
+static unsigned int palm_size;
+module_param(palm_size, uint, 0644);
+MODULE_PARM_DESC(palm_size, "Contact size above which a touchpad contact is considered a palm; halved near the left and right edges ([0] = default, 800).");
+
+static unsigned int dwt_ms;
+module_param(dwt_ms, uint, 0644);
+MODULE_PARM_DESC(dwt_ms, "Disable the touchpad while typing: ignore touchpad contacts for this many ms after a key other than a modifier was pressed ([0] = disabled).");
+
+static unsigned int tp_scroll;
+module_param(tp_scroll, uint, 0444);
+MODULE_PARM_DESC(tp_scroll, "Create an additional input device that reports two-finger scrolling on the touchpad as wheel events ([0] = disabled, 1 = enabled).");
+
+static unsigned int tp_rel_pointer;
+module_param(tp_rel_pointer, uint, 0644);
+MODULE_PARM_DESC(tp_rel_pointer, "Report single-finger movement on the touchpad as relative pointer motion ([0] = disabled, 1 = in addition to the multitouch contacts, 2 = instead of the multitouch contacts).");
+
+static unsigned int tp_rel_speed = 100;
+module_param(tp_rel_speed, uint, 0644);
+MODULE_PARM_DESC(tp_rel_speed, "Relative pointer speed in percent (1-1000, default 100).");
+
+static unsigned int tp_rel_accel = 50;
+module_param(tp_rel_accel, uint, 0644);
+MODULE_PARM_DESC(tp_rel_accel, "Relative pointer acceleration: the percentage by which the speed increases per 100 touchpad units of movement per frame (0-1000, 0 = none, default 50).");
+
+static unsigned int tp_thread = 1;
+module_param(tp_thread, uint, 0444);
+MODULE_PARM_DESC(tp_thread, "Process touchpad frames in a dedicated thread (0 = disabled, process frames as they are received, [1] = enabled).");
+
+static unsigned int tp_thread_policy = SCHED_FIFO;
+module_param(tp_thread_policy, uint, 0444);
+MODULE_PARM_DESC(tp_thread_policy, "Scheduling policy of the thread processing touchpad frames, as in sched.h (0 = SCHED_NORMAL, [1] = SCHED_FIFO, 2 = SCHED_RR).");
+
+static unsigned int tp_thread_prio = 1;
+module_param(tp_thread_prio, uint, 0444);
+MODULE_PARM_DESC(tp_thread_prio, "Realtime priority of the thread processing touchpad frames, for SCHED_FIFO and SCHED_RR (1-99, [1]).");
+
+static unsigned int force_click;
+module_param(force_click, uint, 0444);
+MODULE_PARM_DESC(force_click, "Pressure at which a touchpad click becomes a force click, reported as KEY_PROG1 on a separate input device ([0] = disabled, 1-1023 = threshold).");
+
+static unsigned int debounce_ms;
+module_param(debounce_ms, uint, 0644);
+MODULE_PARM_DESC(debounce_ms, "Ignore further transitions of a key for this many ms after it was pressed or released, to filter out chatter of worn keys ([0] = disabled).");
+
+static unsigned int bl_interval = 50;
+module_param(bl_interval, uint, 0644);
+MODULE_PARM_DESC(bl_interval, "Minimum time in ms between keyboard backlight commands; intermediate levels are skipped (0 = no limit, [50]).");
+
 /**
  * struct keyboard_protocol - keyboard message.
  * message.type = 0x0110, message.length = 0x000a
@@ -214,6 +370,37 @@ struct touchpad_protocol {
 	struct tp_finger	fingers[0];
 };
 
+/**
+ * struct touchpad_info_protocol - touchpad info response.
+ * message.type = 0x1020, message.length = 0x006e
+ *
+ * @unknown1:		unknown
+ * @model_flags:	flags (vary by model number, but significance otherwise
+ *			unknown)
+ * @model_no:		the touchpad model number
+ * @unknown2:		unknown
+ * @crc_16:		crc over the whole message struct (message header +
+ *			this struct) minus this @crc_16 field
+ */
+struct touchpad_info_protocol {
+	__u8			unknown1[105];
+	__u8			model_flags;
+	__u8			model_no;
+	__u8			unknown2[3];
+	__le16			crc_16;
+};
+
+/**
+ * struct command_protocol_tp_info - get touchpad info.
+ * message.type = 0x1020, message.length = 0x0000
+ *
+ * @crc_16:		crc over the whole message struct (message header +
+ *			this struct) minus this @crc_16 field
+ */
+struct command_protocol_tp_info {
+	__le16			crc_16;
+};
+
 /**
  * struct command_protocol_init - initialize touchpad.
  * message.type = 0x0252, message.length = 0x0002
@@ -290,6 +477,8 @@ struct message {
 	union {
 		struct keyboard_protocol	keyboard;
 		struct touchpad_protocol	touchpad;
+		struct touchpad_info_protocol	tp_info;
+		struct command_protocol_tp_info	tp_info_command;
 		struct command_protocol_init	init_command;
 		struct command_protocol_capsl	capsl_command;
 		struct command_protocol_bl	bl_command;
@@ -335,6 +524,236 @@ struct spi_packet {
 	__le16			crc_16;
 } __packed __aligned(2);
 
+struct applespi_data;
+
+enum applespi_cmd_id {
+	APPLESPI_CMD_TP_INFO,
+	APPLESPI_CMD_TP_INIT,
+	APPLESPI_CMD_CAPSL,
+	APPLESPI_CMD_BL,
+	APPLESPI_CMD_NR
+};
+
+/*
+ * Command priority classes. Only one command can be in flight, so the class
+ * determines the order in which queued commands are sent; furthermore bulk
+ * commands yield to an expected interactive one (see interactive_latency).
+ */
+enum applespi_cmd_prio {
+	APPLESPI_PRIO_BULK,		/* e.g. backlight updates */
+	APPLESPI_PRIO_INTERACTIVE,	/* direct user feedback: caps-lock */
+	APPLESPI_PRIO_CONTROL,		/* device setup, e.g. touchpad init */
+	APPLESPI_PRIO_NR
+};
+
+/**
+ * struct applespi_cmd_stats - per priority class command statistics.
+ *
+ * @count:	number of completed commands
+ * @missed:	number of commands that took longer than interactive_latency;
+ *		only counted for interactive commands, the others have no
+ *		latency target (bulk ones are even held back on purpose)
+ * @total_us:	sum of all latencies
+ * @max_us:	the highest latency seen
+ * @hist:	latency histogram; bucket n counts latencies below 2^n us
+ *
+ * The latency is the time from queueing a command till its write exchange
+ * is complete.
+ */
+struct applespi_cmd_stats {
+	u32	count;
+	u32	missed;
+	u64	total_us;
+	u32	max_us;
+	u32	hist[CMD_LAT_BUCKETS];
+};
+
+/**
+ * struct applespi_tp_delay_stats - touchpad frame delivery statistics.
+ *
+ * @count:	number of frames processed
+ * @total_us:	sum of all delays
+ * @total_sq_us: sum of the squares of all delays, for the jitter
+ * @max_us:	the highest delay seen
+ * @hist:	delay histogram; bucket n counts delays below 2^n us
+ *
+ * The delay is the time from the GPE that started the read of a frame till
+ * the frame is processed. These are only updated by whoever processes the
+ * frames, and are read without any locking.
+ */
+struct applespi_tp_delay_stats {
+	u32	count;
+	u64	total_us;
+	u64	total_sq_us;
+	u32	max_us;
+	u32	hist[CMD_LAT_BUCKETS];
+};
+
+/**
+ * struct applespi_cmd_type - static description of a command message.
+ *
+ * @device:	the device the command is sent to (PACKET_DEV_*)
+ * @msg_type:	the message.type of the command
+ * @msg_len:	the length of the command struct, including the trailing crc
+ * @zero:	the value for message.zero (usually 0)
+ * @rsp_buf_len: the value for message.rsp_buf_len; 0 means the same as
+ *		message.length
+ * @prio:	the default priority class of commands of this type
+ * @log_mask:	the DBG_CMD_* mask under which the command is logged
+ */
+struct applespi_cmd_type {
+	u8		device;
+	u16		msg_type;
+	u16		msg_len;
+	u8		zero;
+	u16		rsp_buf_len;
+	enum applespi_cmd_prio	prio;
+	unsigned int	log_mask;
+};
+
+/**
+ * struct applespi_cmd - a command waiting to be sent to the device.
+ *
+ * Commands are kept on the &applespi_data.cmd_queue, ordered by @prio, and
+ * are sent one at a time, since write exchanges may not be interleaved. A
+ * command already on the queue may have its payload updated in place, in
+ * which case the latest payload is what gets sent.
+ *
+ * @list:	entry in the command queue; empty while not queued
+ * @type:	the type of command
+ * @prio:	the priority class of this command
+ * @queued:	when this command was added to the queue
+ * @retries:	how often this command has been resent after a timeout
+ * @complete:	optional callback invoked (with cmd_msg_lock held) once the
+ *		write exchange for this command is done. @status is 0 and
+ *		@rsp is the response message on success; on failure @status
+ *		is a negative errno and @rsp is NULL.
+ * @context:	for use by the submitter
+ * @data:	the payload, as per @type; the crc is filled in when sending
+ */
+struct applespi_cmd {
+	struct list_head		list;
+	const struct applespi_cmd_type	*type;
+	enum applespi_cmd_prio		prio;
+	ktime_t				queued;
+	unsigned int			retries;
+	void (*complete)(struct applespi_data *applespi,
+			 struct applespi_cmd *cmd, int status,
+			 const struct message *rsp);
+	void				*context;
+	union {
+		struct command_protocol_tp_info	tp_info_command;
+		struct command_protocol_init	init_command;
+		struct command_protocol_capsl	capsl_command;
+		struct command_protocol_bl	bl_command;
+		__u8				data[MAX_CMD_PAYLOAD];
+	};
+};
+
+/* offset of message.counter in the spi_packet */
+#define CMD_CNTR_OFFSET	(offsetof(struct spi_packet, data) + \
+			 offsetof(struct message, counter))
+
+/**
+ * struct applespi_cmd_template - a prebuilt command packet.
+ *
+ * Only the message counter and the payload differ between commands of the
+ * same type, so everything else is filled in once, together with the crc
+ * states over the constant prefixes (everything before the counter). The
+ * packet crc furthermore covers the zero padding following the message;
+ * appending a fixed number of zero bytes is a linear map on the crc state,
+ * which is precomputed as its value for each bit of the state.
+ *
+ * @packet:	the packet with all constant fields set and zero payload
+ * @msg_crc:	message crc state after the bytes preceding the counter
+ * @pkt_crc:	packet crc state after the bytes preceding the counter
+ * @pad_len:	number of zero bytes between the message and the packet crc
+ * @pad_crc:	the packet crc after the padding, for each bit of the state
+ *		before the padding
+ */
+struct applespi_cmd_template {
+	struct spi_packet	packet;
+	u16			msg_crc;
+	u16			pkt_crc;
+	unsigned int		pad_len;
+	u16			pad_crc[16];
+};
+
+/**
+ * struct applespi_raw_record - one packet in the raw packet ring.
+ *
+ * @timestamp:	when the packet was received or sent, in ns (monotonic)
+ * @seq:	the ring index this record was written at
+ * @dir:	RAW_DIR_RX for packets read from the device, RAW_DIR_TX for
+ *		packets written to it
+ * @packet:	the complete spi packet, as on the wire
+ */
+struct applespi_raw_record {
+	__u64	timestamp;
+	__u32	seq;
+	__u8	dir;
+	__u8	reserved[3];
+	__u8	packet[APPLESPI_PACKET_SIZE];
+};
+
+/**
+ * struct applespi_raw_ring - the header of the raw packet ring, which is
+ * what userspace gets when mmap'ing the raw device. The records follow at
+ * @data_offset. The ring has a single producer (the driver) and a single
+ * consumer (the process that has the device open).
+ *
+ * The driver writes record @head % @nr_records and then increments @head
+ * (with release semantics); @head is never written by userspace. The reader
+ * consumes records from @tail up to @head and then stores the new @tail,
+ * which is only used to decide whether poll() should report the device as
+ * readable. The driver never waits for the reader: if @head - @tail exceeds
+ * @nr_records, records were overwritten. A reader must therefore re-check
+ * @head after copying a record, and discard the copy if the record could
+ * have been overwritten in the meantime.
+ *
+ * @version:	RAW_RING_VERSION
+ * @nr_records:	number of records in the ring
+ * @record_size: size of each record
+ * @data_offset: offset of the first record from the start of the mapping
+ * @head:	the number of records written so far
+ * @tail:	the number of records consumed so far
+ */
+struct applespi_raw_ring {
+	__u32	version;
+	__u32	nr_records;
+	__u32	record_size;
+	__u32	data_offset;
+	__u32	head;
+	__u32	tail;
+};
+
+/**
+ * struct applespi_raw - the raw packet device. This is allocated separately
+ * from the driver data as it may outlive it, if the device is still open
+ * when the spi device is removed.
+ *
+ * @misc:	the character device
+ * @lock:	protects @applespi and @open
+ * @applespi:	the driver data, or NULL once the spi device is gone
+ * @open:	whether the device is currently open
+ * @ring:	the ring (vmalloc'd, so it can be mapped to userspace)
+ * @ring_size:	size of the @ring allocation
+ * @head:	the driver's copy of the head index
+ * @prod_lock:	serializes producers (the read and write paths)
+ * @wait:	woken whenever a record has been added
+ */
+struct applespi_raw {
+	struct miscdevice		misc;
+	struct mutex			lock;
+	struct applespi_data		*applespi;
+	bool				open;
+	struct applespi_raw_ring	*ring;
+	size_t				ring_size;
+	u32				head;
+	spinlock_t			prod_lock;
+	wait_queue_head_t		wait;
+};
+
 struct spi_settings {
 #ifdef PRE_SPI_PROPERTIES
 	u64	spi_sclk_period;	/* period in ns */
@@ -348,11 +767,141 @@ struct spi_settings {
 	u64	reset_rec_usec;		/* ? (cur val: 10) */
 };
 
+struct applespi_key_translation {
+	u16 from;
+	u16 to;
+	u8 flags;
+};
+
+/**
+ * struct applespi_tp_track - the contacts of the previous touchpad frame.
+ *
+ * @pos:	the contacts' positions
+ * @slots:	the contacts' slots
+ * @n:		number of contacts
+ */
+struct applespi_tp_track {
+	struct input_mt_pos	pos[MAX_FINGERS];
+	int			slots[MAX_FINGERS];
+	int			n;
+};
+
+/**
+ * struct applespi_tp_contacts - the contacts of a touchpad frame, decoded.
+ *
+ * @n:		number of contacts
+ * @palms:	number of contacts dropped as palms
+ * @abs_x:	absolute x coordinates
+ * @abs_y:	absolute y coordinates
+ * @tool_major:	tool area, major axis
+ * @tool_minor:	tool area, minor axis
+ * @orientation: orientation, as reported by the touchpad
+ * @touch_major: touch area, major axis
+ * @touch_minor: touch area, minor axis
+ * @pressure:	pressure
+ *
+ * This holds the fields of struct tp_finger that are used, converted to
+ * native endianness, with one array per field so that each stage after
+ * decoding only touches the fields it needs.
+ */
+struct applespi_tp_contacts {
+	int	n;
+	int	palms;
+	s16	abs_x[MAX_FINGERS];
+	s16	abs_y[MAX_FINGERS];
+	s16	tool_major[MAX_FINGERS];
+	s16	tool_minor[MAX_FINGERS];
+	s16	orientation[MAX_FINGERS];
+	s16	touch_major[MAX_FINGERS];
+	s16	touch_minor[MAX_FINGERS];
+	s16	pressure[MAX_FINGERS];
+};
+
+/**
+ * struct applespi_tp_palms - the palms of the previous touchpad frame.
+ *
+ * @pos:	the palms' positions (raw touchpad coordinates)
+ * @n:		number of palms
+ */
+struct applespi_tp_palms {
+	struct input_mt_pos	pos[MAX_FINGERS];
+	int			n;
+};
+
+/**
+ * struct applespi_tp_scroll - state of the two-finger scroll detector.
+ *
+ * @input:	the scroll input device, or NULL if not enabled
+ * @active:	whether the previous frame was a scroll frame
+ * @last:	centroid of the two contacts in the previous frame
+ * @hi_res:	accumulated movement not yet reported as high-resolution
+ *		wheel units (x, y), scaled by TP_SCROLL_DIST
+ * @wheel:	accumulated high-resolution wheel units not yet reported as
+ *		whole detents (x, y)
+ */
+struct applespi_tp_scroll {
+	struct input_dev	*input;
+	bool			active;
+	struct input_mt_pos	last;
+	int			hi_res[2];
+	int			wheel[2];
+};
+
+/**
+ * struct applespi_tp_rel - state of the relative pointer.
+ *
+ * @active:	whether the previous frame had a single contact
+ * @slot:	the slot of that contact
+ * @last:	the position of that contact
+ * @rem:	accumulated movement not yet reported (x, y), scaled by the
+ *		divisor in applespi_report_rel()
+ */
+struct applespi_tp_rel {
+	bool			active;
+	int			slot;
+	struct input_mt_pos	last;
+	s64			rem[2];
+};
+
+/**
+ * struct applespi_tp_ring - touchpad frames waiting for the touchpad thread.
+ *
+ * @time:	when the read of each frame was started
+ * @frames:	the frames (a struct touchpad_protocol plus its fingers)
+ * @head:	index of the next entry to fill; only written by the
+ *		receive path
+ * @tail:	index of the next entry to process; only written by the
+ *		touchpad thread
+ *
+ * This is a single producer, single consumer ring: the indices only ever
+ * increase, and each side publishes its index with a release store, so
+ * neither side needs a lock.
+ */
+struct applespi_tp_ring {
+	ktime_t		time[TP_RING_SIZE];
+	u8		frames[TP_RING_SIZE][TP_FRAME_MAX_LEN]
+				__aligned(sizeof(__le16));
+	unsigned int	head;
+	unsigned int	tail;
+};
+
+/**
+ * struct applespi_tp_info - touchpad model specific parameters.
+ *
+ * @x_min:	minimum reported x coordinate
+ * @x_max:	maximum reported x coordinate
+ * @y_min:	minimum reported y coordinate
+ * @y_max:	maximum reported y coordinate
+ * @palm_edge:	width of the zones at the left and right edges in which the
+ *		palm size threshold is halved; about 6% of the touchpad's
+ *		width
+ */
 struct applespi_tp_info {
 	int	x_min;
 	int	x_max;
 	int	y_min;
 	int	y_max;
+	int	palm_edge;
 };
 
 struct applespi_data {
@@ -368,13 +917,74 @@ struct applespi_data {
 	u8				*msg_buf;
 	unsigned int			saved_msg_len;
 
-	struct applespi_tp_info		tp_info;
+	/*
+	 * The keycode table as seen by userspace (see EVIOCSKEYCODE), the fn
+	 * and iso translations (settable via sysfs), and the keycode for each
+	 * scancode with fn released ([0]) and pressed ([1]), with the fn and
+	 * iso translations applied. There are two sets of the latter, so one
+	 * can be rebuilt while the other is in use.
+	 */
+	u16				keycodes[MAX_SCANCODES];
+	struct applespi_key_translation	fn_codes[MAX_FN_CODES + 1];
+	struct applespi_key_translation	iso_codes[MAX_ISO_CODES + 1];
+	u16				keymaps[2][2][MAX_SCANCODES];
+	unsigned int			keymap_idx;
+	unsigned int			keymap_gen;
+	/* serializes rebuilds of the keymaps */
+	spinlock_t			keymap_lock;
 
-	u8				last_keys_pressed[MAX_ROLLOVER];
-	u8				last_keys_fn_pressed[MAX_ROLLOVER];
+	struct applespi_tp_info		tp_info;
+	struct applespi_cmd		tp_info_cmd;
+	int				tp_info_status;
+	struct delayed_work		tp_setup_work;
+	u8				tp_model_no;
+	u8				tp_model_flags;
+
+	/* lock to protect the keyboard state below */
+	spinlock_t			kbd_lock;
+	DECLARE_BITMAP(cur_keys_pressed, MAX_SCANCODES);
+	DECLARE_BITMAP(last_keys_pressed, MAX_SCANCODES);
+	u16				last_keycodes[MAX_SCANCODES];
+	u32				key_transitions[MAX_SCANCODES];
+	u8				last_modifiers;
 	u8				last_fn_pressed;
+	struct hrtimer			debounce_timer;
+	u32				kbd_overflows;
+	ktime_t				last_typed;
+	u32				kbd_debounced;
+	struct applespi_tp_contacts	tp_contacts;
+	struct applespi_tp_palms	tp_palm_state;
 	struct input_mt_pos		pos[MAX_FINGERS];
 	int				slots[MAX_FINGERS];
+	struct applespi_tp_track	tp_track;
+	u32				tp_track_by_order;
+	u32				tp_track_by_pos;
+	struct applespi_tp_scroll	tp_scroll;
+	u32				tp_scroll_events;
+	struct applespi_tp_rel		tp_rel;
+	bool				tp_mt_suppressed;
+	struct task_struct		*tp_thread;
+	struct applespi_tp_ring		tp_ring;
+	u32				tp_ring_overflows;
+	struct applespi_tp_delay_stats	tp_delay;
+
+	/* the last frames received, to recognize unchanged frames */
+	struct keyboard_protocol	last_kbd_frame;
+	bool				kbd_frame_valid;
+	struct touchpad_protocol	last_tp_frame;
+	struct tp_finger		last_tp_fingers[MAX_FINGERS];
+	bool				tp_frame_valid;
+	u32				kbd_frames;
+	u32				kbd_frames_elided;
+	u32				tp_frames;
+	u32				tp_frames_elided;
+	u32				tp_frames_idle;
+	bool				tp_idle;
+	u32				tp_palms;
+	u32				tp_dwt_frames;
+	struct input_dev		*force_click_input_dev;
+	u32				tp_force_clicks;
+	bool				force_clicked;
 	acpi_handle			handle;
 	int				gpe;
 	acpi_handle			sien;
@@ -389,23 +999,62 @@ struct applespi_data {
 	struct spi_transfer		st_t;
 	struct spi_message		wr_m;
 
-	bool				want_init_cmd;
+	struct applespi_cmd		init_cmd;
+	struct applespi_cmd		capsl_cmd;
+	struct applespi_cmd		bl_cmd;
 	bool				want_cl_led_on;
-	bool				have_cl_led_on;
 	unsigned int			want_bl_level;
-	unsigned int			have_bl_level;
 	unsigned int			cmd_msg_cntr;
+	u8				cur_cmd_cntr;
 	/* lock to protect the above parameters and flags below */
 	spinlock_t			cmd_msg_lock;
+	struct list_head		cmd_queue;
+	struct applespi_cmd		*cur_cmd;
+	struct applespi_cmd_template	cmd_templates[APPLESPI_CMD_NR];
 	bool				cmd_msg_queued;
 	unsigned int			cmd_log_mask;
+	u32				cmd_queue_depth;
+	u32				cmd_queue_max_depth;
+	u32				cmds_sent;
+	u64				cmd_wait_total_us;
+	u32				cmd_wait_max_us;
+	struct applespi_cmd_stats	cmd_stats[APPLESPI_PRIO_NR];
+	ktime_t				bulk_hold_until;
+	struct hrtimer			cmd_timer;
 
 	struct led_classdev		backlight_info;
+	struct hrtimer			bl_timer;
+	ktime_t				bl_last_queued;
+	u32				bl_requests;
+	u32				bl_cmds_sent;
+	/*
+	 * The led core's brightness is only updated once a fade is done;
+	 * until then the level the fade has reached is kept in bl_value.
+	 */
+	enum led_brightness		bl_value;
+	struct hrtimer			fade_timer;
+	bool				fade_active;
+	ktime_t				fade_start;
+	unsigned int			fade_duration;
+	enum led_brightness		fade_from;
+	enum led_brightness		fade_to;
 
 	bool				drain;
 	wait_queue_head_t		drain_complete;
 	bool				read_active;
 	bool				write_active;
+	bool				write_txfr_active;
+
+	struct hrtimer			watchdog_timer;
+	ktime_t				read_start;
+	ktime_t				write_start;
+	u32				read_timeouts;
+	u32				write_timeouts;
+	u32				stale_rsps;
+	u32				drain_timeouts;
+
+	struct dentry			*debugfs_root;
+	struct applespi_raw		*raw;
 };
 
 static const unsigned char applespi_scancodes[] = {
@@ -438,12 +1087,6 @@ static const unsigned char applespi_controlcodes[] = {
 	KEY_RIGHTMETA
 };
 
-struct applespi_key_translation {
-	u16 from;
-	u16 to;
-	u8 flags;
-};
-
 static const struct applespi_key_translation applespi_fn_codes[] = {
 	{ KEY_BACKSPACE, KEY_DELETE },
 	{ KEY_ENTER,	KEY_INSERT },
@@ -472,19 +1115,75 @@ static const struct applespi_key_translation apple_iso_keyboard[] = {
 	{ },
 };
 
+static const struct applespi_cmd_type applespi_cmd_types[APPLESPI_CMD_NR] = {
+	[APPLESPI_CMD_TP_INFO] = {
+		.device		= PACKET_DEV_INFO,
+		.msg_type	= 0x1020,
+		.msg_len	= sizeof(struct command_protocol_tp_info),
+		.zero		= 0x02,
+		.rsp_buf_len	= 0x0200,
+		.prio		= APPLESPI_PRIO_CONTROL,
+		.log_mask	= DBG_CMD_TP_INI,
+	},
+	[APPLESPI_CMD_TP_INIT] = {
+		.device		= PACKET_DEV_TPAD,
+		.msg_type	= 0x0252,
+		.msg_len	= sizeof(struct command_protocol_init),
+		.prio		= APPLESPI_PRIO_CONTROL,
+		.log_mask	= DBG_CMD_TP_INI,
+	},
+	[APPLESPI_CMD_CAPSL] = {
+		.device		= PACKET_DEV_KEYB,
+		.msg_type	= 0x0151,
+		.msg_len	= sizeof(struct command_protocol_capsl),
+		.prio		= APPLESPI_PRIO_INTERACTIVE,
+		.log_mask	= DBG_CMD_CL,
+	},
+	[APPLESPI_CMD_BL] = {
+		.device		= PACKET_DEV_KEYB,
+		.msg_type	= 0xB051,
+		.msg_len	= sizeof(struct command_protocol_bl),
+		.prio		= APPLESPI_PRIO_BULK,
+		.log_mask	= DBG_CMD_BL,
+	},
+};
+
 static struct applespi_tp_info applespi_macbookpro131_info = {
-	-6243, 6749, -170, 7685
+	-6243, 6749, -170, 7685, 800
 };
 
 static struct applespi_tp_info applespi_macbookpro133_info = {
-	-7456, 7976, -163, 9283
+	-7456, 7976, -163, 9283, 950
 };
 
 /* MacBook8, MacBook9, MacBook10 */
 static struct applespi_tp_info applespi_default_info = {
-	-5087, 5579, -182, 6089
+	-5087, 5579, -182, 6089, 650
+};
+
+struct applespi_tp_model_info {
+	u8				model;
+	struct applespi_tp_info		*tp_info;
+};
+
+/* touchpad dimensions by the model number reported by the device */
+static const struct applespi_tp_model_info applespi_tp_models[] = {
+	{
+		.model = 0x04,	/* MB8 MB9 MB10 */
+		.tp_info = &applespi_default_info,
+	},
+	{
+		.model = 0x05,	/* MBP13,1 MBP13,2 MBP14,1 MBP14,2 */
+		.tp_info = &applespi_macbookpro131_info,
+	},
+	{
+		.model = 0x06,	/* MBP13,3 MBP14,3 */
+		.tp_info = &applespi_macbookpro133_info,
+	},
+	{ }
 };
 
+/* fallback for when the touchpad model could not be queried */
 static const struct dmi_system_id applespi_touchpad_infos[] = {
 	{
 		.ident = "Apple MacBookPro13,1",
@@ -779,6 +1478,36 @@ static int applespi_get_spi_settings(struct applespi_data *applespi)
 
 #endif
 
+static enum hrtimer_restart applespi_watchdog(struct hrtimer *timer);
+static enum hrtimer_restart applespi_bl_timer(struct hrtimer *timer);
+static enum hrtimer_restart applespi_cmd_timer(struct hrtimer *timer);
+static enum hrtimer_restart applespi_fade_timer(struct hrtimer *timer);
+static enum hrtimer_restart applespi_debounce_timer(struct hrtimer *timer);
+static void applespi_tp_info_complete(struct applespi_data *applespi,
+				      struct applespi_cmd *cmd, int status,
+				      const struct message *rsp);
+static void applespi_init_complete(struct applespi_data *applespi,
+				   struct applespi_cmd *cmd, int status,
+				   const struct message *rsp);
+static void applespi_bl_complete(struct applespi_data *applespi,
+				 struct applespi_cmd *cmd, int status,
+				 const struct message *rsp);
+
+static void applespi_setup_cmd_templates(struct applespi_data *applespi);
+
+static void applespi_init_cmd(struct applespi_cmd *cmd,
+			      enum applespi_cmd_id id,
+			      void (*complete)(struct applespi_data *,
+					       struct applespi_cmd *, int,
+					       const struct message *))
+{
+	memset(cmd, 0, sizeof(*cmd));
+	INIT_LIST_HEAD(&cmd->list);
+	cmd->type = &applespi_cmd_types[id];
+	cmd->prio = cmd->type->prio;
+	cmd->complete = complete;
+}
+
 static int applespi_setup_spi(struct applespi_data *applespi)
 {
 	int sts;
@@ -795,6 +1524,30 @@ static int applespi_setup_spi(struct applespi_data *applespi)
 	spin_lock_init(&applespi->cmd_msg_lock);
 	init_waitqueue_head(&applespi->drain_complete);
 
+	hrtimer_init(&applespi->watchdog_timer, CLOCK_MONOTONIC,
+		     HRTIMER_MODE_REL);
+	applespi->watchdog_timer.function = applespi_watchdog;
+
+	hrtimer_init(&applespi->bl_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	applespi->bl_timer.function = applespi_bl_timer;
+
+	hrtimer_init(&applespi->cmd_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	applespi->cmd_timer.function = applespi_cmd_timer;
+
+	hrtimer_init(&applespi->fade_timer, CLOCK_MONOTONIC,
+		     HRTIMER_MODE_REL);
+	applespi->fade_timer.function = applespi_fade_timer;
+
+	INIT_LIST_HEAD(&applespi->cmd_queue);
+	applespi_init_cmd(&applespi->tp_info_cmd, APPLESPI_CMD_TP_INFO,
+			  applespi_tp_info_complete);
+	applespi_init_cmd(&applespi->init_cmd, APPLESPI_CMD_TP_INIT,
+			  applespi_init_complete);
+	applespi_init_cmd(&applespi->capsl_cmd, APPLESPI_CMD_CAPSL, NULL);
+	applespi_init_cmd(&applespi->bl_cmd, APPLESPI_CMD_BL,
+			  applespi_bl_complete);
+	applespi_setup_cmd_templates(applespi);
+
 	return 0;
 }
 
@@ -828,22 +1581,88 @@ static int applespi_enable_spi(struct applespi_data *applespi)
 
 static int applespi_send_cmd_msg(struct applespi_data *applespi);
 
+/*
+ * Must be called with cmd_msg_lock held. The timer is shared by reads and
+ * writes; if it is already pending or running, the callback will re-arm it
+ * as long as anything is still outstanding.
+ */
+static void applespi_arm_watchdog(struct applespi_data *applespi)
+{
+	if (!watchdog_timeout || hrtimer_active(&applespi->watchdog_timer))
+		return;
+
+	hrtimer_start(&applespi->watchdog_timer,
+		      ms_to_ktime(watchdog_timeout), HRTIMER_MODE_REL);
+}
+
+/* Account the latency of a command that is being finished. */
+static void applespi_update_cmd_stats(struct applespi_data *applespi,
+				      struct applespi_cmd *cmd)
+{
+	struct applespi_cmd_stats *stats = &applespi->cmd_stats[cmd->prio];
+	u32 lat_us = ktime_us_delta(ktime_get(), cmd->queued);
+
+	stats->count++;
+	stats->total_us += lat_us;
+	if (lat_us > stats->max_us)
+		stats->max_us = lat_us;
+	if (cmd->prio == APPLESPI_PRIO_INTERACTIVE &&
+	    lat_us > interactive_latency * USEC_PER_MSEC)
+		stats->missed++;
+	stats->hist[min(fls(lat_us), CMD_LAT_BUCKETS - 1)]++;
+}
+
+/*
+ * Finish the command currently in flight, if any. Must be called with
+ * cmd_msg_lock held.
+ */
+static void applespi_complete_cmd(struct applespi_data *applespi, int status,
+				  const struct message *rsp)
+{
+	struct applespi_cmd *cmd = applespi->cur_cmd;
+
+	applespi->cur_cmd = NULL;
+
+	if (cmd)
+		applespi_update_cmd_stats(applespi, cmd);
+
+	if (cmd && cmd->complete)
+		cmd->complete(applespi, cmd, status, rsp);
+}
+
 static void applespi_msg_complete(struct applespi_data *applespi,
-				  bool is_write_msg, bool is_read_compl)
+				  bool is_write_msg, bool is_read_compl,
+				  const struct message *rsp)
 {
 	unsigned long flags;
 
 	spin_lock_irqsave(&applespi->cmd_msg_lock, flags);
 
+	/*
+	 * The response to a write that was abandoned (see
+	 * applespi_recover_write()) may still turn up; it must not be taken
+	 * for the response to whatever was sent since.
+	 */
+	if (is_write_msg && rsp &&
+	    (!applespi->write_active ||
+	     rsp->counter != applespi->cur_cmd_cntr)) {
+		dev_warn_ratelimited(&applespi->spi->dev,
+				     "Dropping stale write response: counter=%02x\n",
+				     rsp->counter);
+		applespi->stale_rsps++;
+		is_write_msg = false;
+	}
+
 	if (is_read_compl)
 		applespi->read_active = false;
 	if (is_write_msg)
 		applespi->write_active = false;
 
-	if (applespi->drain && !applespi->write_active)
+	if (applespi->drain)
 		wake_up_all(&applespi->drain_complete);
 
 	if (is_write_msg) {
+		applespi_complete_cmd(applespi, rsp ? 0 : -EIO, rsp);
 		applespi->cmd_msg_queued = false;
 		applespi_send_cmd_msg(applespi);
 	}
@@ -854,6 +1673,11 @@ static void applespi_msg_complete(struct applespi_data *applespi,
 static void applespi_async_write_complete(void *context)
 {
 	struct applespi_data *applespi = context;
+	unsigned long flags;
+
+	spin_lock_irqsave(&applespi->cmd_msg_lock, flags);
+	applespi->write_txfr_active = false;
+	spin_unlock_irqrestore(&applespi->cmd_msg_lock, flags);
 
 	debug_print(applespi->cmd_log_mask, "--- %s ------------------------\n",
 		    applespi_debug_facility(applespi->cmd_log_mask));
@@ -867,631 +1691,3361 @@ static void applespi_async_write_complete(void *context)
 		 * If we got an error, we presumably won't get the expected
 		 * response message either.
 		 */
-		applespi_msg_complete(applespi, true, false);
+		applespi_msg_complete(applespi, true, false, NULL);
 }
 
-static int applespi_send_cmd_msg(struct applespi_data *applespi)
+static void applespi_setup_cmd_template(struct applespi_cmd_template *tmpl,
+					const struct applespi_cmd_type *type)
 {
-	u16 crc;
-	int sts;
-	struct spi_packet *packet = (struct spi_packet *)applespi->tx_buffer;
+	struct spi_packet *packet = &tmpl->packet;
 	struct message *message = (struct message *)packet->data;
-	u16 msg_len;
-	u8 device;
+	u16 msg_len = type->msg_len;
+	unsigned int pad_off;
+	int i;
 
-	/* check if draining */
-	if (applespi->drain)
-		return 0;
+	memset(packet, 0, sizeof(*packet));
 
-	/* check whether send is in progress */
-	if (applespi->cmd_msg_queued)
-		return 0;
+	packet->flags = PACKET_TYPE_WRITE;
+	packet->device = type->device;
+	packet->length = cpu_to_le16(MSG_HEADER_SIZE + msg_len);
 
-	/* set up packet */
-	memset(packet, 0, APPLESPI_PACKET_SIZE);
+	message->type = cpu_to_le16(type->msg_type);
+	message->zero = type->zero;
+	message->length = cpu_to_le16(msg_len - 2);
+	if (type->rsp_buf_len)
+		message->rsp_buf_len = cpu_to_le16(type->rsp_buf_len);
+	else
+		message->rsp_buf_len = message->length;
 
-	/* are we processing init commands? */
-	if (applespi->want_init_cmd) {
-		applespi->want_init_cmd = false;
-		applespi->cmd_log_mask = DBG_CMD_TP_INI;
+	tmpl->msg_crc = crc16(0, (u8 *)message, offsetof(struct message,
+							 counter));
+	tmpl->pkt_crc = crc16(0, (u8 *)packet, CMD_CNTR_OFFSET);
 
-		/* build init command */
-		device = PACKET_DEV_TPAD;
+	pad_off = offsetof(struct spi_packet, data) + MSG_HEADER_SIZE + msg_len;
+	tmpl->pad_len = offsetof(struct spi_packet, crc_16) - pad_off;
 
-		message->type = cpu_to_le16(0x0252);
-		msg_len = sizeof(message->init_command);
+	for (i = 0; i < ARRAY_SIZE(tmpl->pad_crc); i++)
+		tmpl->pad_crc[i] = crc16(BIT(i), (u8 *)packet + pad_off,
+					 tmpl->pad_len);
+}
 
-		message->init_command.cmd = cpu_to_le16(0x0102);
+static void applespi_setup_cmd_templates(struct applespi_data *applespi)
+{
+	int i;
 
-	/* do we need caps-lock command? */
-	} else if (applespi->want_cl_led_on != applespi->have_cl_led_on) {
-		applespi->have_cl_led_on = applespi->want_cl_led_on;
-		applespi->cmd_log_mask = DBG_CMD_CL;
+	for (i = 0; i < APPLESPI_CMD_NR; i++)
+		applespi_setup_cmd_template(&applespi->cmd_templates[i],
+					    &applespi_cmd_types[i]);
+}
 
-		/* build led command */
-		device = PACKET_DEV_KEYB;
+/*
+ * Build the packet for the given command in @buf, starting from the
+ * command type's template: this only needs to compute the crc's over the
+ * bytes that actually vary, i.e. the counter and the payload.
+ */
+static void applespi_build_cmd(struct applespi_data *applespi,
+			       const struct applespi_cmd *cmd, u8 counter,
+			       u8 *buf)
+{
+	const struct applespi_cmd_template *tmpl =
+		&applespi->cmd_templates[cmd->type - applespi_cmd_types];
+	struct spi_packet *packet = (struct spi_packet *)buf;
+	struct message *message = (struct message *)packet->data;
+	u16 msg_len = cmd->type->msg_len;
+	u16 crc, pad_crc;
+	int i;
 
-		message->type = cpu_to_le16(0x0151);
-		msg_len = sizeof(message->capsl_command);
+	memcpy(packet, &tmpl->packet, sizeof(*packet));
 
-		message->capsl_command.unknown = 0x01;
-		message->capsl_command.led = applespi->have_cl_led_on ? 2 : 0;
+	message->counter = counter;
+	memcpy(message->data, cmd->data, msg_len - 2);
 
-	/* do we need backlight command? */
-	} else if (applespi->want_bl_level != applespi->have_bl_level) {
-		applespi->have_bl_level = applespi->want_bl_level;
-		applespi->cmd_log_mask = DBG_CMD_BL;
+	/* message crc: counter up to the end of the payload */
+	crc = crc16(tmpl->msg_crc, &message->counter,
+		    MSG_HEADER_SIZE - offsetof(struct message, counter) +
+		    msg_len - 2);
+	*((__le16 *)&message->data[msg_len - 2]) = cpu_to_le16(crc);
 
-		/* build command buffer */
-		device = PACKET_DEV_KEYB;
+	/* packet crc: counter up to the end of the message, then padding */
+	crc = crc16(tmpl->pkt_crc, &message->counter,
+		    MSG_HEADER_SIZE - offsetof(struct message, counter) +
+		    msg_len);
 
-		message->type = cpu_to_le16(0xB051);
-		msg_len = sizeof(message->bl_command);
+	for (pad_crc = 0, i = 0; crc; crc >>= 1, i++) {
+		if (crc & 1)
+			pad_crc ^= tmpl->pad_crc[i];
+	}
+	packet->crc_16 = cpu_to_le16(pad_crc);
+}
 
-		message->bl_command.const1 = cpu_to_le16(0x01B0);
-		message->bl_command.level =
-				cpu_to_le16(applespi->have_bl_level);
+/*
+ * Add a packet to the raw packet ring, if anybody is listening. This is called
+ * on both the read and the write paths, which may run concurrently.
+ */
+static void applespi_raw_log(struct applespi_data *applespi, u8 dir,
+			     const u8 *packet)
+{
+	struct applespi_raw *raw = applespi->raw;
+	struct applespi_raw_record *rec;
+	unsigned long flags;
 
-		if (applespi->have_bl_level > 0)
-			message->bl_command.const2 = cpu_to_le16(0x01F4);
-		else
-			message->bl_command.const2 = cpu_to_le16(0x0001);
+	if (!raw || !READ_ONCE(raw->open))
+		return;
 
-	/* everything's up-to-date */
-	} else {
-		return 0;
-	}
+	spin_lock_irqsave(&raw->prod_lock, flags);
 
-	/* finalize packet */
-	packet->flags = PACKET_TYPE_WRITE;
-	packet->device = device;
-	packet->length = cpu_to_le16(MSG_HEADER_SIZE + msg_len);
+	rec = (void *)raw->ring + PAGE_SIZE +
+	      (raw->head % RAW_RING_RECORDS) * sizeof(*rec);
 
-	message->counter = applespi->cmd_msg_cntr++ & 0xff;
+	rec->timestamp = ktime_get_ns();
+	rec->seq = raw->head;
+	rec->dir = dir;
+	memcpy(rec->packet, packet, APPLESPI_PACKET_SIZE);
 
-	message->length = cpu_to_le16(msg_len - 2);
-	message->rsp_buf_len = message->length;
+	raw->head++;
+	smp_store_release(&raw->ring->head, raw->head);
 
-	crc = crc16(0, (u8 *)message, le16_to_cpu(packet->length) - 2);
-	*((__le16 *)&message->data[msg_len - 2]) = cpu_to_le16(crc);
+	spin_unlock_irqrestore(&raw->prod_lock, flags);
 
-	crc = crc16(0, (u8 *)packet, sizeof(*packet) - 2);
-	packet->crc_16 = cpu_to_le16(crc);
+	wake_up_interruptible(&raw->wait);
+}
 
-	/* send command */
-	sts = applespi_async(applespi, &applespi->wr_m,
-			     applespi_async_write_complete);
+/*
+ * Send the next command on the queue, if the protocol allows it right now.
+ * Must be called with cmd_msg_lock held.
+ */
+static int applespi_send_cmd_msg(struct applespi_data *applespi)
+{
+	int sts;
+	struct applespi_cmd *cmd;
+	u32 wait_us;
+
+	/* check if draining */
+	if (applespi->drain)
+		return 0;
+
+	/* check whether send is in progress */
+	if (applespi->cmd_msg_queued)
+		return 0;
+
+	/* anything to send? */
+	cmd = list_first_entry_or_null(&applespi->cmd_queue,
+				       struct applespi_cmd, list);
+	if (!cmd)
+		return 0;
+
+	/* bulk commands yield while an interactive one is expected */
+	if (cmd->prio == APPLESPI_PRIO_BULK &&
+	    ktime_before(ktime_get(), applespi->bulk_hold_until)) {
+		hrtimer_start(&applespi->cmd_timer, applespi->bulk_hold_until,
+			      HRTIMER_MODE_ABS);
+		return 0;
+	}
+
+	if (cmd->prio == APPLESPI_PRIO_INTERACTIVE)
+		applespi->bulk_hold_until = 0;
+
+	list_del_init(&cmd->list);
+	applespi->cmd_queue_depth--;
+
+	wait_us = ktime_us_delta(ktime_get(), cmd->queued);
+	applespi->cmd_wait_total_us += wait_us;
+	if (wait_us > applespi->cmd_wait_max_us)
+		applespi->cmd_wait_max_us = wait_us;
+	applespi->cmds_sent++;
+
+	applespi->cmd_log_mask = cmd->type->log_mask;
+
+	/* set up packet; the response carries the same counter */
+	applespi->cur_cmd_cntr = applespi->cmd_msg_cntr++ & 0xff;
+	applespi_build_cmd(applespi, cmd, applespi->cur_cmd_cntr,
+			   applespi->tx_buffer);
+
+	applespi_raw_log(applespi, RAW_DIR_TX, applespi->tx_buffer);
+
+	/* send command */
+	applespi->cur_cmd = cmd;
+
+	sts = applespi_async(applespi, &applespi->wr_m,
+			     applespi_async_write_complete);
 
 	if (sts != 0) {
 		pr_warn("Error queueing async write to device: %d\n", sts);
+		applespi_complete_cmd(applespi, sts, NULL);
 	} else {
 		applespi->cmd_msg_queued = true;
 		applespi->write_active = true;
+		applespi->write_txfr_active = true;
+		applespi->write_start = ktime_get();
+		applespi_arm_watchdog(applespi);
 	}
 
 	return sts;
 }
 
-static void applespi_init(struct applespi_data *applespi)
+static enum hrtimer_restart applespi_cmd_timer(struct hrtimer *timer)
 {
+	struct applespi_data *applespi =
+		container_of(timer, struct applespi_data, cmd_timer);
 	unsigned long flags;
 
 	spin_lock_irqsave(&applespi->cmd_msg_lock, flags);
-
-	applespi->want_init_cmd = true;
 	applespi_send_cmd_msg(applespi);
-
 	spin_unlock_irqrestore(&applespi->cmd_msg_lock, flags);
+
+	return HRTIMER_NORESTART;
 }
 
-static int applespi_set_capsl_led(struct applespi_data *applespi,
-				  bool capslock_on)
+/*
+ * Called when an interactive command is about to be submitted (e.g. caps-lock
+ * was pressed, so the led will change shortly): hold back bulk commands for
+ * a bit, so the interactive command doesn't end up waiting for a complete
+ * bulk write exchange.
+ */
+static void applespi_hold_bulk_cmds(struct applespi_data *applespi)
 {
 	unsigned long flags;
-	int sts;
 
 	spin_lock_irqsave(&applespi->cmd_msg_lock, flags);
-
-	applespi->want_cl_led_on = capslock_on;
-	sts = applespi_send_cmd_msg(applespi);
-
+	applespi->bulk_hold_until = ktime_add_ms(ktime_get(),
+						 interactive_latency);
 	spin_unlock_irqrestore(&applespi->cmd_msg_lock, flags);
-
-	return sts;
 }
 
-static void applespi_set_bl_level(struct led_classdev *led_cdev,
-				  enum led_brightness value)
-
+static void applespi_insert_cmd(struct applespi_data *applespi,
+				struct applespi_cmd *cmd, bool at_head)
 {
-	struct applespi_data *applespi =
-		container_of(led_cdev, struct applespi_data, backlight_info);
-	unsigned long flags;
-	int sts;
-
-	spin_lock_irqsave(&applespi->cmd_msg_lock, flags);
-
-	if (value == 0)
-		applespi->want_bl_level = value;
-	else
-		/*
-		 * The backlight does not turn on till level 32, so we scale
-		 * the range here so that from a user's perspective it turns
-		 * on at 1.
-		 */
-		applespi->want_bl_level = (unsigned int)
-			((value * KBD_BL_LEVEL_ADJ) / KBD_BL_LEVEL_SCALE +
-			 MIN_KBD_BL_LEVEL);
+	struct applespi_cmd *pos;
 
-	sts = applespi_send_cmd_msg(applespi);
+	/* find the first command we should go in front of */
+	list_for_each_entry(pos, &applespi->cmd_queue, list) {
+		if (pos->prio < cmd->prio ||
+		    (at_head && pos->prio == cmd->prio))
+			break;
+	}
+	list_add_tail(&cmd->list, &pos->list);
 
-	spin_unlock_irqrestore(&applespi->cmd_msg_lock, flags);
+	applespi->cmd_queue_depth++;
+	if (applespi->cmd_queue_depth > applespi->cmd_queue_max_depth)
+		applespi->cmd_queue_max_depth = applespi->cmd_queue_depth;
 }
 
-static int applespi_event(struct input_dev *dev, unsigned int type,
-			  unsigned int code, int value)
+/*
+ * Add a command to the queue and kick off sending if the device is idle. If
+ * the command is already queued nothing is added, but the (possibly updated)
+ * payload will still be sent. Must be called with cmd_msg_lock held.
+ */
+static int applespi_queue_cmd(struct applespi_data *applespi,
+			      struct applespi_cmd *cmd)
 {
-	struct applespi_data *applespi = input_get_drvdata(dev);
-
-	switch (type) {
-	case EV_LED:
-		applespi_set_capsl_led(applespi,
-				       !!test_bit(LED_CAPSL, dev->led));
-		return 0;
+	if (list_empty(&cmd->list)) {
+		cmd->queued = ktime_get();
+		cmd->retries = 0;
+		applespi_insert_cmd(applespi, cmd, false);
 	}
 
-	return -1;
+	return applespi_send_cmd_msg(applespi);
 }
 
-/* lifted from the BCM5974 driver */
-/* convert 16-bit little endian to signed integer */
-static inline int raw2int(__le16 x)
+/*
+ * Drop all queued commands, e.g. on removal. Must be called with
+ * cmd_msg_lock held.
+ */
+static void applespi_flush_cmds(struct applespi_data *applespi)
 {
-	return (signed short)le16_to_cpu(x);
-}
+	struct applespi_cmd *cmd, *tmp;
 
-static void report_finger_data(struct input_dev *input, int slot,
-			       const struct input_mt_pos *pos,
-			       const struct tp_finger *f)
-{
-	input_mt_slot(input, slot);
-	input_mt_report_slot_state(input, MT_TOOL_FINGER, true);
+	list_for_each_entry_safe(cmd, tmp, &applespi->cmd_queue, list) {
+		list_del_init(&cmd->list);
+		applespi->cmd_queue_depth--;
 
-	input_report_abs(input, ABS_MT_TOUCH_MAJOR,
-			 raw2int(f->touch_major) << 1);
-	input_report_abs(input, ABS_MT_TOUCH_MINOR,
-			 raw2int(f->touch_minor) << 1);
-	input_report_abs(input, ABS_MT_WIDTH_MAJOR,
-			 raw2int(f->tool_major) << 1);
-	input_report_abs(input, ABS_MT_WIDTH_MINOR,
-			 raw2int(f->tool_minor) << 1);
-	input_report_abs(input, ABS_MT_ORIENTATION,
-			 MAX_FINGER_ORIENTATION - raw2int(f->orientation));
-	input_report_abs(input, ABS_MT_POSITION_X, pos->x);
-	input_report_abs(input, ABS_MT_POSITION_Y, pos->y);
+		if (cmd->complete)
+			cmd->complete(applespi, cmd, -ESHUTDOWN, NULL);
+	}
 }
 
-static int report_tp_state(struct applespi_data *applespi,
-			   struct touchpad_protocol *t)
+/*
+ * Take a command off the queue, or forget about it if it is in flight, so
+ * that its callback won't be invoked anymore. Must be called with
+ * cmd_msg_lock held.
+ */
+static void applespi_detach_cmd(struct applespi_data *applespi,
+				struct applespi_cmd *cmd)
 {
-	static int min_x, max_x, min_y, max_y;
-	static bool dim_updated;
-	static ktime_t last_print;
-
-	const struct tp_finger *f;
-	struct input_dev *input = applespi->touchpad_input_dev;
-	const struct applespi_tp_info *tp_info = &applespi->tp_info;
-	int i, n;
+	if (!list_empty(&cmd->list)) {
+		list_del_init(&cmd->list);
+		applespi->cmd_queue_depth--;
+	}
+	if (applespi->cur_cmd == cmd)
+		applespi->cur_cmd = NULL;
+}
 
-	n = 0;
+struct applespi_sync_ctx {
+	struct completion	done;
+	struct message		*rsp;
+	size_t			rsp_len;
+	int			status;
+};
 
-	for (i = 0; i < t->number_of_fingers; i++) {
-		f = &t->fingers[i];
-		if (raw2int(f->touch_major) == 0)
-			continue;
-		applespi->pos[n].x = raw2int(f->abs_x);
-		applespi->pos[n].y = tp_info->y_min + tp_info->y_max -
-				     raw2int(f->abs_y);
-		n++;
+static void applespi_sync_cmd_complete(struct applespi_data *applespi,
+				       struct applespi_cmd *cmd, int status,
+				       const struct message *rsp)
+{
+	struct applespi_sync_ctx *ctx = cmd->context;
+	size_t len;
+
+	if (!status) {
+		len = min_t(size_t, MSG_HEADER_SIZE + le16_to_cpu(rsp->length),
+			    ctx->rsp_len);
+		if (len)
+			memcpy(ctx->rsp, rsp, len);
+		status = len;
+	}
 
-		if (debug & DBG_TP_DIM) {
-			#define UPDATE_DIMENSIONS(val, op, last) \
-				do { \
-					if (raw2int(val) op last) { \
-						last = raw2int(val); \
-						dim_updated = true; \
-					} \
-				} while (0)
+	ctx->status = status;
+	complete(&ctx->done);
+}
 
-			UPDATE_DIMENSIONS(f->abs_x, <, min_x);
-			UPDATE_DIMENSIONS(f->abs_x, >, max_x);
-			UPDATE_DIMENSIONS(f->abs_y, <, min_y);
-			UPDATE_DIMENSIONS(f->abs_y, >, max_y);
-		}
-	}
+/*
+ * Send a command and wait for the response, for at most @timeout ms. The
+ * response message (header and payload, minus the crc) is copied to @rsp,
+ * truncated to @rsp_len bytes, and the number of bytes copied is returned.
+ * @rsp may be NULL if only the completion is of interest. Returns a
+ * negative errno on failure.
+ *
+ * Must not be called from atomic context. The command's callback and context
+ * are overwritten.
+ */
+static int applespi_send_cmd_sync(struct applespi_data *applespi,
+				  struct applespi_cmd *cmd,
+				  struct message *rsp, size_t rsp_len,
+				  unsigned int timeout)
+{
+	struct applespi_sync_ctx ctx;
+	unsigned long flags;
+	int sts;
 
-	if (debug & DBG_TP_DIM) {
-		if (dim_updated &&
-		    ktime_ms_delta(ktime_get(), last_print) > 1000) {
-			printk(KERN_DEBUG
-			       pr_fmt("New touchpad dimensions: %d %d %d %d\n"),
-			       min_x, max_x, min_y, max_y);
-			dim_updated = false;
-			last_print = ktime_get();
-		}
-	}
+	init_completion(&ctx.done);
+	ctx.rsp = rsp;
+	ctx.rsp_len = rsp ? rsp_len : 0;
+	ctx.status = -ETIMEDOUT;
 
-	input_mt_assign_slots(input, applespi->slots, applespi->pos, n, 0);
+	cmd->complete = applespi_sync_cmd_complete;
+	cmd->context = &ctx;
 
-	for (i = 0; i < n; i++)
-		report_finger_data(input, applespi->slots[i],
-				   &applespi->pos[i], &t->fingers[i]);
+	spin_lock_irqsave(&applespi->cmd_msg_lock, flags);
+	applespi_queue_cmd(applespi, cmd);
+	spin_unlock_irqrestore(&applespi->cmd_msg_lock, flags);
 
-	input_mt_sync_frame(input);
-	input_report_key(input, BTN_LEFT, t->clicked);
+	wait_for_completion_timeout(&ctx.done, msecs_to_jiffies(timeout));
 
-	input_sync(input);
-	return 0;
-}
+	/* make sure the command isn't referenced anymore once we return */
+	spin_lock_irqsave(&applespi->cmd_msg_lock, flags);
 
-static const struct applespi_key_translation *applespi_find_translation(
-		const struct applespi_key_translation *table, u16 key)
-{
-	const struct applespi_key_translation *trans;
+	applespi_detach_cmd(applespi, cmd);
+	sts = ctx.status;
 
-	for (trans = table; trans->from; trans++)
-		if (trans->from == key)
-			return trans;
+	spin_unlock_irqrestore(&applespi->cmd_msg_lock, flags);
 
-	return NULL;
+	return sts;
 }
 
-static unsigned int applespi_code_to_key(u8 code, int fn_pressed)
+static void applespi_recover_write(struct applespi_data *applespi)
 {
-	unsigned int key = applespi_scancodes[code];
-	const struct applespi_key_translation *trans;
-
-	if (fnmode) {
-		int do_translate;
+	struct applespi_cmd *cmd = applespi->cur_cmd;
 
-		trans = applespi_find_translation(applespi_fn_codes, key);
-		if (trans) {
-			if (trans->flags & APPLE_FLAG_FKEY)
-				do_translate = (fnmode == 2 && fn_pressed) ||
-					       (fnmode == 1 && !fn_pressed);
-			else
-				do_translate = fn_pressed;
+	applespi->write_timeouts++;
 
-			if (do_translate)
-				key = trans->to;
-		}
+	if (cmd && ++cmd->retries <= MAX_CMD_RETRIES) {
+		dev_warn_ratelimited(&applespi->spi->dev,
+				     "Timed out waiting for write response - resending command\n");
+		/* a newer payload may have been queued in the meantime */
+		applespi->cur_cmd = NULL;
+		if (list_empty(&cmd->list))
+			applespi_insert_cmd(applespi, cmd, true);
+	} else {
+		dev_warn_ratelimited(&applespi->spi->dev,
+				     "Timed out waiting for write response - giving up on command\n");
+		applespi_complete_cmd(applespi, -ETIMEDOUT, NULL);
 	}
 
-	if (iso_layout) {
-		trans = applespi_find_translation(apple_iso_keyboard, key);
-		if (trans)
-			key = trans->to;
-	}
+	applespi->cmd_msg_queued = false;
+	applespi->write_active = false;
 
-	return key;
+	if (applespi->drain)
+		wake_up_all(&applespi->drain_complete);
+
+	applespi_send_cmd_msg(applespi);
 }
 
-static void applespi_handle_keyboard_event(struct applespi_data *applespi,
-					   struct keyboard_protocol
-							*keyboard_protocol)
+/*
+ * A write exchange is only complete once the response message has been read,
+ * which requires a GPE from the device. If that never arrives, the command
+ * state machine would stay blocked forever (and with it suspend and remove).
+ * This watchdog bounds that wait: once the response is overdue, the exchange
+ * is abandoned and the command is sent again.
+ *
+ * Note that we can only recover once the spi transfers themselves have
+ * completed, as until then the spi_message still belongs to the spi core;
+ * so for reads, and for writes whose status has not been read yet, all we
+ * can do is reset the message reassembly and complain. Draining (suspend,
+ * remove) doesn't wait for those forever though, see applespi_wait_drained().
+ */
+static enum hrtimer_restart applespi_watchdog(struct hrtimer *timer)
 {
-	int i, j;
-	unsigned int key;
-	bool still_pressed;
-	bool is_overflow;
-
-	/* check for rollover overflow, which is signalled by all keys == 1 */
-	is_overflow = true;
-
-	for (i = 0; i < MAX_ROLLOVER; i++) {
-		if (keyboard_protocol->keys_pressed[i] != 1) {
-			is_overflow = false;
-			break;
-		}
-	}
+	struct applespi_data *applespi =
+		container_of(timer, struct applespi_data, watchdog_timer);
+	enum hrtimer_restart restart = HRTIMER_NORESTART;
+	unsigned long flags;
+	ktime_t now;
 
-	if (is_overflow)
-		return;
+	spin_lock_irqsave(&applespi->cmd_msg_lock, flags);
 
-	/* check released keys */
-	for (i = 0; i < MAX_ROLLOVER; i++) {
-		still_pressed = false;
-		for (j = 0; j < MAX_ROLLOVER; j++) {
-			if (applespi->last_keys_pressed[i] ==
-			    keyboard_protocol->keys_pressed[j]) {
-				still_pressed = true;
-				break;
-			}
-		}
+	now = ktime_get();
 
-		if (!still_pressed) {
-			key = applespi_code_to_key(
-					applespi->last_keys_pressed[i],
-					applespi->last_keys_fn_pressed[i]);
-			input_report_key(applespi->keyboard_input_dev, key, 0);
-			applespi->last_keys_fn_pressed[i] = 0;
+	if (applespi->write_active &&
+	    ktime_ms_delta(now, applespi->write_start) >= watchdog_timeout) {
+		if (!applespi->write_txfr_active) {
+			applespi_recover_write(applespi);
+		} else {
+			applespi->write_timeouts++;
+			dev_warn_ratelimited(&applespi->spi->dev,
+					     "Timed out waiting for write to complete\n");
+			applespi->write_start = now;
 		}
 	}
 
-	/* check pressed keys */
-	for (i = 0; i < MAX_ROLLOVER; i++) {
-		if (keyboard_protocol->keys_pressed[i] <
-				ARRAY_SIZE(applespi_scancodes) &&
-		    keyboard_protocol->keys_pressed[i] > 0) {
-			key = applespi_code_to_key(
-					keyboard_protocol->keys_pressed[i],
-					keyboard_protocol->fn_pressed);
-			input_report_key(applespi->keyboard_input_dev, key, 1);
-			applespi->last_keys_fn_pressed[i] =
-					keyboard_protocol->fn_pressed;
-		}
+	if (applespi->read_active &&
+	    ktime_ms_delta(now, applespi->read_start) >= watchdog_timeout) {
+		applespi->read_timeouts++;
+		dev_warn_ratelimited(&applespi->spi->dev,
+				     "Timed out waiting for read to complete\n");
+		applespi->saved_msg_len = 0;
+		applespi->read_start = now;
 	}
 
-	/* check control keys */
-	for (i = 0; i < MAX_MODIFIERS; i++) {
-		u8 *modifiers = &keyboard_protocol->modifiers;
-
-		if (test_bit(i, (unsigned long *)modifiers)) {
-			input_report_key(applespi->keyboard_input_dev,
-					 applespi_controlcodes[i], 1);
-		} else {
-			input_report_key(applespi->keyboard_input_dev,
-					 applespi_controlcodes[i], 0);
-		}
+	if (watchdog_timeout &&
+	    (applespi->read_active || applespi->write_active)) {
+		hrtimer_forward_now(timer, ms_to_ktime(watchdog_timeout));
+		restart = HRTIMER_RESTART;
 	}
 
-	/* check function key */
-	if (keyboard_protocol->fn_pressed && !applespi->last_fn_pressed) {
-		input_report_key(applespi->keyboard_input_dev, KEY_FN, 1);
-	} else if (!keyboard_protocol->fn_pressed &&
-		   applespi->last_fn_pressed) {
-		input_report_key(applespi->keyboard_input_dev, KEY_FN, 0);
-	}
-	applespi->last_fn_pressed = keyboard_protocol->fn_pressed;
+	spin_unlock_irqrestore(&applespi->cmd_msg_lock, flags);
 
-	/* done */
-	input_sync(applespi->keyboard_input_dev);
-	memcpy(&applespi->last_keys_pressed, keyboard_protocol->keys_pressed,
-	       sizeof(applespi->last_keys_pressed));
+	return restart;
 }
 
-static void applespi_handle_cmd_response(struct applespi_data *applespi,
-					 struct spi_packet *packet,
-					 struct message *message)
+static void applespi_init_complete(struct applespi_data *applespi,
+				   struct applespi_cmd *cmd, int status,
+				   const struct message *rsp)
 {
-	if (le16_to_cpu(message->length) != 0x0000) {
-		dev_warn_ratelimited(&applespi->spi->dev,
-				     "Received unexpected write response: length=%x\n",
-				     le16_to_cpu(message->length));
-		return;
-	}
-
-	if (packet->device == PACKET_DEV_TPAD &&
-	    le16_to_cpu(message->type) == 0x0252 &&
-	    le16_to_cpu(message->rsp_buf_len) == 0x0002)
+	if (!status && le16_to_cpu(rsp->type) == 0x0252 &&
+	    le16_to_cpu(rsp->rsp_buf_len) == 0x0002)
 		pr_info("modeswitch done.\n");
 }
 
-static bool applespi_verify_crc(struct applespi_data *applespi, u8 *buffer,
-				size_t buflen)
+static void applespi_init(struct applespi_data *applespi)
 {
-	u16 crc;
+	unsigned long flags;
 
-	crc = crc16(0, buffer, buflen);
-	if (crc != 0) {
-		dev_warn_ratelimited(&applespi->spi->dev,
-				     "Received corrupted packet (crc mismatch)\n");
-		return false;
-	}
+	spin_lock_irqsave(&applespi->cmd_msg_lock, flags);
 
-	return true;
+	applespi->init_cmd.init_command.cmd = cpu_to_le16(0x0102);
+	applespi_queue_cmd(applespi, &applespi->init_cmd);
+
+	spin_unlock_irqrestore(&applespi->cmd_msg_lock, flags);
 }
 
-static void applespi_debug_print_read_packet(struct applespi_data *applespi,
-					     struct spi_packet *packet)
+/* Must be called with cmd_msg_lock held. */
+static int applespi_queue_capsl_cmd(struct applespi_data *applespi)
 {
-	unsigned int dbg_mask;
+	struct command_protocol_capsl *capsl =
+					&applespi->capsl_cmd.capsl_command;
 
-	if (packet->flags == PACKET_TYPE_READ &&
-	    packet->device == PACKET_DEV_KEYB) {
-		dbg_mask = DBG_RD_KEYB;
+	capsl->unknown = 0x01;
+	capsl->led = applespi->want_cl_led_on ? 2 : 0;
 
-	} else if (packet->flags == PACKET_TYPE_READ &&
-		   packet->device == PACKET_DEV_TPAD) {
+	return applespi_queue_cmd(applespi, &applespi->capsl_cmd);
+}
+
+/* Must be called with cmd_msg_lock held. */
+static int applespi_queue_bl_cmd(struct applespi_data *applespi)
+{
+	struct command_protocol_bl *bl = &applespi->bl_cmd.bl_command;
+
+	bl->const1 = cpu_to_le16(0x01B0);
+	bl->level = cpu_to_le16(applespi->want_bl_level);
+
+	if (applespi->want_bl_level > 0)
+		bl->const2 = cpu_to_le16(0x01F4);
+	else
+		bl->const2 = cpu_to_le16(0x0001);
+
+	applespi->bl_last_queued = ktime_get();
+
+	return applespi_queue_cmd(applespi, &applespi->bl_cmd);
+}
+
+static void applespi_bl_complete(struct applespi_data *applespi,
+				 struct applespi_cmd *cmd, int status,
+				 const struct message *rsp)
+{
+	applespi->bl_cmds_sent++;
+}
+
+static enum hrtimer_restart applespi_bl_timer(struct hrtimer *timer)
+{
+	struct applespi_data *applespi =
+		container_of(timer, struct applespi_data, bl_timer);
+	unsigned long flags;
+
+	spin_lock_irqsave(&applespi->cmd_msg_lock, flags);
+	applespi_queue_bl_cmd(applespi);
+	spin_unlock_irqrestore(&applespi->cmd_msg_lock, flags);
+
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Desktop environments fade the backlight by writing many levels in quick
+ * succession, each of which would otherwise cost a complete write exchange.
+ * So we send at most one backlight command per bl_interval; the timer picks
+ * up whatever level was requested last when it fires. Must be called with
+ * cmd_msg_lock held.
+ */
+static void applespi_schedule_bl_cmd(struct applespi_data *applespi)
+{
+	ktime_t next;
+
+	/* nothing can be sent while draining; resume restores the level */
+	if (applespi->drain || hrtimer_active(&applespi->bl_timer))
+		return;
+
+	next = ktime_add_ms(applespi->bl_last_queued, bl_interval);
+
+	if (!bl_interval || !ktime_before(ktime_get(), next))
+		applespi_queue_bl_cmd(applespi);
+	else
+		hrtimer_start(&applespi->bl_timer, next, HRTIMER_MODE_ABS);
+}
+
+static int applespi_set_capsl_led(struct applespi_data *applespi,
+				  bool capslock_on)
+{
+	unsigned long flags;
+	int sts;
+
+	spin_lock_irqsave(&applespi->cmd_msg_lock, flags);
+
+	applespi->want_cl_led_on = capslock_on;
+	sts = applespi_queue_capsl_cmd(applespi);
+
+	spin_unlock_irqrestore(&applespi->cmd_msg_lock, flags);
+
+	return sts;
+}
+
+/*
+ * Set the desired backlight level from an led brightness value. Must be
+ * called with cmd_msg_lock held.
+ */
+static void applespi_update_bl_level(struct applespi_data *applespi,
+				     enum led_brightness value)
+{
+	unsigned int level;
+
+	if (value == 0)
+		level = value;
+	else
+		/*
+		 * The backlight does not turn on till level 32, so we scale
+		 * the range here so that from a user's perspective it turns
+		 * on at 1.
+		 */
+		level = (unsigned int)
+			((value * KBD_BL_LEVEL_ADJ) / KBD_BL_LEVEL_SCALE +
+			 MIN_KBD_BL_LEVEL);
+
+	if (level != applespi->want_bl_level) {
+		applespi->want_bl_level = level;
+		applespi_schedule_bl_cmd(applespi);
+	}
+}
+
+static void applespi_set_bl_level(struct led_classdev *led_cdev,
+				  enum led_brightness value)
+
+{
+	struct applespi_data *applespi =
+		container_of(led_cdev, struct applespi_data, backlight_info);
+	unsigned long flags;
+
+	spin_lock_irqsave(&applespi->cmd_msg_lock, flags);
+
+	/*
+	 * An explicit brightness overrides any fade in progress; the fade
+	 * timer stops once it sees this. This is also how a finished fade
+	 * hands its final level to the led core.
+	 */
+	applespi->fade_active = false;
+
+	applespi->bl_requests++;
+	applespi->bl_value = value;
+	applespi_update_bl_level(applespi, value);
+
+	spin_unlock_irqrestore(&applespi->cmd_msg_lock, flags);
+}
+
+static unsigned int applespi_fade_step(void)
+{
+	return max_t(unsigned int, bl_interval, MIN_KBD_BL_FADE_STEP);
+}
+
+/*
+ * Advance the fade to the current time, returning true when it is done, in
+ * which case the caller must pass the target to the led core. Must be called
+ * with cmd_msg_lock held.
+ */
+static bool applespi_step_fade(struct applespi_data *applespi)
+{
+	s64 elapsed = ktime_ms_delta(ktime_get(), applespi->fade_start);
+	int from = applespi->fade_from;
+	int to = applespi->fade_to;
+
+	if (elapsed >= applespi->fade_duration)
+		return true;
+
+	applespi->bl_value = from + (int)div_s64((s64)(to - from) * elapsed,
+						 applespi->fade_duration);
+	applespi_update_bl_level(applespi, applespi->bl_value);
+
+	return false;
+}
+
+static enum hrtimer_restart applespi_fade_timer(struct hrtimer *timer)
+{
+	struct applespi_data *applespi =
+		container_of(timer, struct applespi_data, fade_timer);
+	enum led_brightness target = applespi->fade_to;
+	unsigned long flags;
+	bool done;
+
+	spin_lock_irqsave(&applespi->cmd_msg_lock, flags);
+	done = !applespi->fade_active || applespi_step_fade(applespi);
+	spin_unlock_irqrestore(&applespi->cmd_msg_lock, flags);
+
+	if (!done) {
+		hrtimer_forward_now(timer, ms_to_ktime(applespi_fade_step()));
+		return HRTIMER_RESTART;
+	}
+
+	/* unless a new brightness was set meanwhile, hand over to the core */
+	if (applespi->fade_active)
+		led_set_brightness_nosleep(&applespi->backlight_info, target);
+
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Stop a fade in progress. If @finish is set the backlight jumps to the
+ * fade's target level, otherwise it stays wherever the fade got to.
+ */
+static void applespi_stop_fade(struct applespi_data *applespi, bool finish)
+{
+	unsigned long flags;
+	bool active;
+
+	hrtimer_cancel(&applespi->fade_timer);
+
+	spin_lock_irqsave(&applespi->cmd_msg_lock, flags);
+	active = applespi->fade_active;
+	applespi->fade_active = false;
+	spin_unlock_irqrestore(&applespi->cmd_msg_lock, flags);
+
+	if (active && finish)
+		led_set_brightness_nosleep(&applespi->backlight_info,
+					   applespi->fade_to);
+}
+
+/*
+ * Fade the backlight to @target over @duration ms. The steps are taken here
+ * rather than having userspace write each intermediate brightness, and no
+ * faster than backlight commands are sent anyway (see bl_interval).
+ */
+static void applespi_start_fade(struct applespi_data *applespi,
+				enum led_brightness target,
+				unsigned int duration)
+{
+	unsigned long flags;
+
+	applespi_stop_fade(applespi, false);
+
+	applespi->fade_to = target;
+	applespi->fade_duration = duration;
+
+	if (!duration) {
+		led_set_brightness_nosleep(&applespi->backlight_info, target);
+		return;
+	}
+
+	spin_lock_irqsave(&applespi->cmd_msg_lock, flags);
+
+	applespi->fade_from = applespi->bl_value;
+	applespi->fade_start = ktime_get();
+	applespi->fade_active = true;
+
+	spin_unlock_irqrestore(&applespi->cmd_msg_lock, flags);
+
+	hrtimer_start(&applespi->fade_timer, ms_to_ktime(applespi_fade_step()),
+		      HRTIMER_MODE_REL);
+}
+
+static ssize_t fade_show(struct device *dev, struct device_attribute *attr,
+			 char *buf)
+{
+	struct led_classdev *led_cdev = dev_get_drvdata(dev);
+	struct applespi_data *applespi =
+		container_of(led_cdev, struct applespi_data, backlight_info);
+
+	return sprintf(buf, "%u %u\n", applespi->fade_to,
+		       applespi->fade_duration);
+}
+
+/* accepts "<target brightness> <duration in ms>" */
+static ssize_t fade_store(struct device *dev, struct device_attribute *attr,
+			  const char *buf, size_t count)
+{
+	struct led_classdev *led_cdev = dev_get_drvdata(dev);
+	struct applespi_data *applespi =
+		container_of(led_cdev, struct applespi_data, backlight_info);
+	unsigned int target, duration;
+
+	if (sscanf(buf, "%u %u", &target, &duration) != 2)
+		return -EINVAL;
+
+	if (target > led_cdev->max_brightness)
+		target = led_cdev->max_brightness;
+	if (duration > MAX_KBD_BL_FADE_TIME)
+		duration = MAX_KBD_BL_FADE_TIME;
+
+	applespi_start_fade(applespi, target, duration);
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(fade);
+
+static struct attribute *applespi_bl_attrs[] = {
+	&dev_attr_fade.attr,
+	NULL
+};
+
+ATTRIBUTE_GROUPS(applespi_bl);
+
+static int applespi_event(struct input_dev *dev, unsigned int type,
+			  unsigned int code, int value)
+{
+	struct applespi_data *applespi = input_get_drvdata(dev);
+
+	switch (type) {
+	case EV_LED:
+		applespi_set_capsl_led(applespi,
+				       !!test_bit(LED_CAPSL, dev->led));
+		return 0;
+	}
+
+	return -1;
+}
+
+/* lifted from the BCM5974 driver */
+/* convert 16-bit little endian to signed integer */
+static inline int raw2int(__le16 x)
+{
+	return (signed short)le16_to_cpu(x);
+}
+
+static void report_finger_data(struct input_dev *input, int slot,
+			       const struct input_mt_pos *pos,
+			       const struct applespi_tp_contacts *c, int i)
+{
+	input_mt_slot(input, slot);
+	input_mt_report_slot_state(input, MT_TOOL_FINGER, true);
+
+	input_report_abs(input, ABS_MT_TOUCH_MAJOR, c->touch_major[i] << 1);
+	input_report_abs(input, ABS_MT_TOUCH_MINOR, c->touch_minor[i] << 1);
+	input_report_abs(input, ABS_MT_WIDTH_MAJOR, c->tool_major[i] << 1);
+	input_report_abs(input, ABS_MT_WIDTH_MINOR, c->tool_minor[i] << 1);
+	input_report_abs(input, ABS_MT_ORIENTATION,
+			 MAX_FINGER_ORIENTATION - c->orientation[i]);
+	input_report_abs(input, ABS_MT_PRESSURE,
+			 clamp_t(int, c->pressure[i], 0, MAX_FINGER_PRESSURE));
+	input_report_abs(input, ABS_MT_POSITION_X, pos->x);
+	input_report_abs(input, ABS_MT_POSITION_Y, pos->y);
+}
+
+/*
+ * Check whether a touchpad frame is the same as the previous one (ignoring
+ * the crc), in which case there is nothing to report.
+ */
+static bool applespi_tp_frame_repeated(struct applespi_data *applespi,
+				       const struct touchpad_protocol *t)
+{
+	struct touchpad_protocol *last = &applespi->last_tp_frame;
+	bool same;
+	int i;
+
+	applespi->tp_frames++;
+
+	same = applespi->tp_frame_valid &&
+	       t->clicked == last->clicked &&
+	       t->number_of_fingers == last->number_of_fingers;
+
+	for (i = 0; same && i < t->number_of_fingers; i++)
+		same = !memcmp(&t->fingers[i], &applespi->last_tp_fingers[i],
+			       offsetof(struct tp_finger, crc_16));
+
+	if (same) {
+		applespi->tp_frames_elided++;
+		return true;
+	}
+
+	*last = *t;
+	memcpy(applespi->last_tp_fingers, t->fingers,
+	       t->number_of_fingers * sizeof(t->fingers[0]));
+	applespi->tp_frame_valid = true;
+
+	return false;
+}
+
+/*
+ * A contact is considered a palm if its average contact size, or its approach
+ * size (which is larger for a palm hovering just above the surface), exceeds
+ * the threshold; near the left and right edges, where palms usually rest
+ * while typing, a smaller size suffices.
+ */
+static bool applespi_is_palm(const struct applespi_tp_info *tp_info,
+			     const struct applespi_tp_contacts *c, int i)
+{
+	int size = (c->touch_major[i] + c->touch_minor[i]) / 2;
+	int threshold = palm_size ?: TP_PALM_SIZE;
+	int x = c->abs_x[i];
+
+	if (x < tp_info->x_min + tp_info->palm_edge ||
+	    x > tp_info->x_max - tp_info->palm_edge)
+		threshold /= 2;
+
+	return size > threshold || c->tool_major[i] > 2 * threshold;
+}
+
+/*
+ * Once a contact has been found to be a palm it stays one until it is lifted,
+ * so a palm whose size hovers around the threshold doesn't keep turning into
+ * a finger and back: each palm of the previous frame marks the contact
+ * closest to it, if within TP_TRACK_MAX_DIST, as still being that palm.
+ */
+static void applespi_match_palms(const struct applespi_tp_palms *prev,
+				 const struct applespi_tp_contacts *c, int nr,
+				 bool *palm)
+{
+	int dx, dy, dist, best_dist, best;
+	int i, p;
+
+	for (p = 0; p < prev->n; p++) {
+		best = -1;
+		best_dist = TP_TRACK_MAX_DIST * TP_TRACK_MAX_DIST;
+
+		for (i = 0; i < nr; i++) {
+			if (!c->touch_major[i])
+				continue;
+			dx = c->abs_x[i] - prev->pos[p].x;
+			dy = c->abs_y[i] - prev->pos[p].y;
+			dist = dx * dx + dy * dy;
+			if (dist <= best_dist) {
+				best_dist = dist;
+				best = i;
+			}
+		}
+
+		if (best >= 0)
+			palm[best] = true;
+	}
+}
+
+static void applespi_move_contact(struct applespi_tp_contacts *c, int to,
+				  int from)
+{
+	c->abs_x[to] = c->abs_x[from];
+	c->abs_y[to] = c->abs_y[from];
+	c->tool_major[to] = c->tool_major[from];
+	c->tool_minor[to] = c->tool_minor[from];
+	c->orientation[to] = c->orientation[from];
+	c->touch_major[to] = c->touch_major[from];
+	c->touch_minor[to] = c->touch_minor[from];
+	c->pressure[to] = c->pressure[from];
+}
+
+/*
+ * Decode the contacts of a touchpad frame in one pass, then drop those that
+ * are not to be reported: ones that have already been lifted and, if palms
+ * is given, palms. palms holds the palms of the previous frame, and is
+ * updated to those of this frame.
+ */
+static void applespi_decode_contacts(const struct applespi_tp_info *tp_info,
+				     const struct touchpad_protocol *t,
+				     struct applespi_tp_contacts *c,
+				     struct applespi_tp_palms *palms)
+{
+	const struct tp_finger *f = t->fingers;
+	int nr = t->number_of_fingers;
+	struct input_mt_pos palm_pos[MAX_FINGERS];
+	bool palm[MAX_FINGERS] = { 0 };
+	int i, n;
+
+	for (i = 0; i < nr; i++) {
+		c->abs_x[i] = raw2int(f[i].abs_x);
+		c->abs_y[i] = raw2int(f[i].abs_y);
+		c->tool_major[i] = raw2int(f[i].tool_major);
+		c->tool_minor[i] = raw2int(f[i].tool_minor);
+		c->orientation[i] = raw2int(f[i].orientation);
+		c->touch_major[i] = raw2int(f[i].touch_major);
+		c->touch_minor[i] = raw2int(f[i].touch_minor);
+		c->pressure[i] = raw2int(f[i].pressure);
+	}
+
+	c->palms = 0;
+
+	if (palms)
+		applespi_match_palms(palms, c, nr, palm);
+
+	for (i = 0, n = 0; i < nr; i++) {
+		if (!c->touch_major[i])
+			continue;
+		if (palms && (palm[i] || applespi_is_palm(tp_info, c, i))) {
+			palm_pos[c->palms].x = c->abs_x[i];
+			palm_pos[c->palms].y = c->abs_y[i];
+			c->palms++;
+			continue;
+		}
+		if (n != i)
+			applespi_move_contact(c, n, i);
+		n++;
+	}
+
+	c->n = n;
+
+	if (palms) {
+		memcpy(palms->pos, palm_pos, c->palms * sizeof(palm_pos[0]));
+		palms->n = c->palms;
+	}
+}
+
+/*
+ * The touchpad appears to report contacts in a stable order, with new contacts
+ * appended at the end. If the first contacts of this frame are each close to
+ * the contact at the same index in the previous frame, they are taken to be
+ * the same contacts and keep their slots, while any additional contacts get
+ * free slots. Anything else (e.g. a contact being lifted) is not considered
+ * consistent, and false is returned so the caller can fall back to
+ * input_mt_assign_slots().
+ */
+static bool applespi_track_by_order(const struct applespi_tp_track *prev,
+				    const struct input_mt_pos *pos, int *slots,
+				    int n)
+{
+	unsigned long used = 0;
+	int dx, dy;
+	int i, slot;
+
+	if (n < prev->n)
+		return false;
+
+	for (i = 0; i < prev->n; i++) {
+		dx = pos[i].x - prev->pos[i].x;
+		dy = pos[i].y - prev->pos[i].y;
+		if (dx * dx + dy * dy > TP_TRACK_MAX_DIST * TP_TRACK_MAX_DIST)
+			return false;
+
+		slots[i] = prev->slots[i];
+		used |= BIT(slots[i]);
+	}
+
+	for (slot = 0; i < n; i++, slot++) {
+		while (used & BIT(slot))
+			slot++;
+		slots[i] = slot;
+	}
+
+	return true;
+}
+
+static void applespi_assign_slots(struct applespi_data *applespi,
+				  struct input_dev *input, int n)
+{
+	struct applespi_tp_track *track = &applespi->tp_track;
+
+	if (READ_ONCE(tp_tracking) &&
+	    applespi_track_by_order(track, applespi->pos, applespi->slots, n)) {
+		applespi->tp_track_by_order++;
+	} else {
+		input_mt_assign_slots(input, applespi->slots, applespi->pos, n,
+				      0);
+		applespi->tp_track_by_pos++;
+	}
+
+	memcpy(track->pos, applespi->pos, n * sizeof(track->pos[0]));
+	memcpy(track->slots, applespi->slots, n * sizeof(track->slots[0]));
+	track->n = n;
+}
+
+/*
+ * Turn a click into a force click once the hardest pressed contact reaches
+ * the force_click threshold, and back once it drops below 3/4 of it, so that
+ * a pressure hovering around the threshold doesn't toggle the key.
+ */
+static void applespi_report_force_click(struct applespi_data *applespi,
+					const struct applespi_tp_contacts *c,
+					bool clicked)
+{
+	struct input_dev *input = applespi->force_click_input_dev;
+	int threshold = force_click;
+	int pressure = 0;
+	int i;
+
+	if (!input)
+		return;
+
+	for (i = 0; i < c->n; i++)
+		pressure = max_t(int, pressure, c->pressure[i]);
+
+	if (!applespi->force_clicked) {
+		if (!clicked || pressure < threshold)
+			return;
+		applespi->force_clicked = true;
+		applespi->tp_force_clicks++;
+	} else {
+		if (clicked &&
+		    pressure >= threshold - threshold / FORCE_CLICK_HYST)
+			return;
+		applespi->force_clicked = false;
+	}
+
+	input_report_key(input, KEY_PROG1, applespi->force_clicked);
+	input_sync(input);
+}
+
+/*
+ * Convert a movement into wheel units, keeping the remainders for the next
+ * frame. Returns the number of high-resolution units, and stores the number
+ * of whole detents in *detents.
+ */
+static int applespi_scroll_axis(int delta, int *hi_res, int *wheel,
+				int *detents)
+{
+	int units;
+
+	*hi_res += delta * WHEEL_DETENT;
+	units = *hi_res / TP_SCROLL_DIST;
+	*hi_res -= units * TP_SCROLL_DIST;
+
+	*wheel += units;
+	*detents = *wheel / WHEEL_DETENT;
+	*wheel -= *detents * WHEEL_DETENT;
+
+	return units;
+}
+
+/*
+ * Two-finger scroll detector: while exactly two contacts are down and the
+ * touchpad isn't clicked, the movement of their centroid is reported as wheel
+ * events on the scroll input device.
+ */
+static void applespi_report_scroll(struct applespi_data *applespi, int n,
+				   bool clicked)
+{
+	struct applespi_tp_scroll *scroll = &applespi->tp_scroll;
+	struct input_mt_pos c;
+	int hwheel, hwheel_hi, wheel, wheel_hi;
+
+	if (!scroll->input)
+		return;
+
+	if (n != 2 || clicked) {
+		scroll->active = false;
+		return;
+	}
+
+	c.x = (applespi->pos[0].x + applespi->pos[1].x) / 2;
+	c.y = (applespi->pos[0].y + applespi->pos[1].y) / 2;
+
+	if (!scroll->active) {
+		memset(scroll->hi_res, 0, sizeof(scroll->hi_res));
+		memset(scroll->wheel, 0, sizeof(scroll->wheel));
+		scroll->last = c;
+		scroll->active = true;
+		return;
+	}
+
+	/* moving the fingers up or right scrolls up or right */
+	hwheel_hi = applespi_scroll_axis(c.x - scroll->last.x,
+					 &scroll->hi_res[0], &scroll->wheel[0],
+					 &hwheel);
+	wheel_hi = applespi_scroll_axis(scroll->last.y - c.y,
+					&scroll->hi_res[1], &scroll->wheel[1],
+					&wheel);
+	scroll->last = c;
+
+	if (!hwheel_hi && !wheel_hi)
+		return;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+	if (wheel_hi)
+		input_report_rel(scroll->input, REL_WHEEL_HI_RES, wheel_hi);
+	if (hwheel_hi)
+		input_report_rel(scroll->input, REL_HWHEEL_HI_RES, hwheel_hi);
+#endif
+	if (wheel)
+		input_report_rel(scroll->input, REL_WHEEL, wheel);
+	if (hwheel)
+		input_report_rel(scroll->input, REL_HWHEEL, hwheel);
+
+	input_sync(scroll->input);
+	applespi->tp_scroll_events++;
+}
+
+/*
+ * Relative pointer: the movement of a single contact is scaled by
+ *
+ *   tp_rel_speed% * (1 + tp_rel_accel% * speed / TP_REL_ACCEL_SPEED)
+ *
+ * and reported as REL_X/REL_Y, keeping the remainders for the next frame.
+ */
+static void applespi_report_rel(struct applespi_data *applespi,
+				struct input_dev *input, int n)
+{
+	const s32 div = 100 * 100 * TP_REL_ACCEL_SPEED * TP_REL_DIV;
+	struct applespi_tp_rel *rel = &applespi->tp_rel;
+	int speed = clamp(READ_ONCE(tp_rel_speed), 1U, 1000U);
+	int accel = min(READ_ONCE(tp_rel_accel), 1000U);
+	int d[2], out[2];
+	s64 gain;
+	int i;
+
+	if (n != 1 || (rel->active && rel->slot != applespi->slots[0])) {
+		rel->active = false;
+		if (n != 1)
+			return;
+	}
+
+	if (!rel->active) {
+		rel->active = true;
+		rel->slot = applespi->slots[0];
+		rel->last = applespi->pos[0];
+		rel->rem[0] = 0;
+		rel->rem[1] = 0;
+		return;
+	}
+
+	d[0] = applespi->pos[0].x - rel->last.x;
+	d[1] = applespi->pos[0].y - rel->last.y;
+	rel->last = applespi->pos[0];
+
+	gain = (s64)speed * (100 * TP_REL_ACCEL_SPEED +
+			     accel * int_sqrt(d[0] * d[0] + d[1] * d[1]));
+
+	for (i = 0; i < 2; i++) {
+		rel->rem[i] += d[i] * gain;
+		out[i] = div_s64(rel->rem[i], div);
+		rel->rem[i] -= (s64)out[i] * div;
+	}
+
+	if (out[0])
+		input_report_rel(input, REL_X, out[0]);
+	if (out[1])
+		input_report_rel(input, REL_Y, out[1]);
+}
+
+/*
+ * Disable-while-typing: check whether a key was pressed within dwt_ms of the
+ * touchpad frame.
+ */
+static bool applespi_dwt_active(struct applespi_data *applespi, ktime_t time)
+{
+	unsigned int window = READ_ONCE(dwt_ms);
+
+	return window &&
+	       ktime_ms_delta(time, READ_ONCE(applespi->last_typed)) < window;
+}
+
+static int report_tp_state(struct applespi_data *applespi,
+			   struct touchpad_protocol *t, ktime_t time)
+{
+	static int min_x, max_x, min_y, max_y;
+	static bool dim_updated;
+	static ktime_t last_print;
+
+	struct applespi_tp_contacts *c = &applespi->tp_contacts;
+	struct input_dev *input;
+	const struct applespi_tp_info *tp_info = &applespi->tp_info;
+	unsigned int rel_pointer;
+	int i, n;
+
+	/* touchpad_input_dev is only set once the touchpad has been set up */
+	input = smp_load_acquire(&applespi->touchpad_input_dev);
+	if (!input)
+		return 0;
+
+	if (READ_ONCE(palm_rejection)) {
+		applespi_decode_contacts(tp_info, t, c,
+					 &applespi->tp_palm_state);
+	} else {
+		applespi_decode_contacts(tp_info, t, c, NULL);
+		applespi->tp_palm_state.n = 0;
+	}
+	applespi->tp_palms += c->palms;
+
+	/* while typing, the frame is handled as if there were no contacts */
+	if (c->n && applespi_dwt_active(applespi, time)) {
+		applespi->tp_dwt_frames++;
+		c->n = 0;
+	}
+
+	n = c->n;
+
+	for (i = 0; i < n; i++) {
+		applespi->pos[i].x = c->abs_x[i];
+		applespi->pos[i].y = tp_info->y_min + tp_info->y_max -
+				     c->abs_y[i];
+
+		if (debug & DBG_TP_DIM) {
+			#define UPDATE_DIMENSIONS(val, op, last) \
+				do { \
+					if (val op last) { \
+						last = val; \
+						dim_updated = true; \
+					} \
+				} while (0)
+
+			UPDATE_DIMENSIONS(c->abs_x[i], <, min_x);
+			UPDATE_DIMENSIONS(c->abs_x[i], >, max_x);
+			UPDATE_DIMENSIONS(c->abs_y[i], <, min_y);
+			UPDATE_DIMENSIONS(c->abs_y[i], >, max_y);
+		}
+	}
+
+	/*
+	 * The touchpad keeps sending frames for a while after the last
+	 * contact has been lifted; report the first of them so everything
+	 * is released, and drop the rest until there is something to report.
+	 */
+	if (!n && !t->clicked) {
+		if (applespi->tp_idle) {
+			applespi->tp_frames_idle++;
+			return 0;
+		}
+		applespi->tp_idle = true;
+	} else {
+		applespi->tp_idle = false;
+	}
+
+	if (debug & DBG_TP_DIM) {
+		if (dim_updated &&
+		    ktime_ms_delta(ktime_get(), last_print) > 1000) {
+			printk(KERN_DEBUG
+			       pr_fmt("New touchpad dimensions: %d %d %d %d\n"),
+			       min_x, max_x, min_y, max_y);
+			dim_updated = false;
+			last_print = ktime_get();
+		}
+	}
+
+	applespi_assign_slots(applespi, input, n);
+
+	rel_pointer = READ_ONCE(tp_rel_pointer);
+
+	if (rel_pointer)
+		applespi_report_rel(applespi, input, n);
+	else
+		applespi->tp_rel.active = false;
+
+	if (rel_pointer < 2) {
+		for (i = 0; i < n; i++)
+			report_finger_data(input, applespi->slots[i],
+					   &applespi->pos[i], c, i);
+
+		input_mt_sync_frame(input);
+		applespi->tp_mt_suppressed = false;
+	} else if (!applespi->tp_mt_suppressed) {
+		/* release all contacts once */
+		input_mt_sync_frame(input);
+		applespi->tp_mt_suppressed = true;
+	}
+	input_report_key(input, BTN_LEFT, t->clicked);
+	applespi_report_force_click(applespi, c, t->clicked);
+
+	/*
+	 * The touchpad isn't known to send a timestamp of its own, so use the
+	 * time of the GPE that started the frame's read; unlike the time the
+	 * frame is reported at, that isn't affected by delays in the read
+	 * path or in getting to run the touchpad thread.
+	 */
+	input_event(input, EV_MSC, MSC_TIMESTAMP, (u32)ktime_to_us(time));
+
+	input_sync(input);
+
+	applespi_report_scroll(applespi, n, t->clicked);
+	return 0;
+}
+
+static void applespi_process_tp_frame(struct applespi_data *applespi,
+				      struct touchpad_protocol *tp,
+				      ktime_t time)
+{
+	struct applespi_tp_delay_stats *stats = &applespi->tp_delay;
+	u32 delay_us = ktime_us_delta(ktime_get(), time);
+
+	stats->count++;
+	stats->total_us += delay_us;
+	stats->total_sq_us += (u64)delay_us * delay_us;
+	if (delay_us > stats->max_us)
+		stats->max_us = delay_us;
+	stats->hist[min(fls(delay_us), CMD_LAT_BUCKETS - 1)]++;
+
+	if (!applespi_tp_frame_repeated(applespi, tp))
+		report_tp_state(applespi, tp, time);
+}
+
+/*
+ * Hand a touchpad frame to the touchpad thread. This is called from the
+ * receive path and never blocks; if the thread has fallen too far behind the
+ * frame is dropped.
+ */
+static void applespi_queue_tp_frame(struct applespi_data *applespi,
+				    const struct touchpad_protocol *tp,
+				    ktime_t time)
+{
+	struct applespi_tp_ring *ring = &applespi->tp_ring;
+	unsigned int head = ring->head;
+	unsigned int idx = head % TP_RING_SIZE;
+
+	if (head - smp_load_acquire(&ring->tail) >= TP_RING_SIZE) {
+		applespi->tp_ring_overflows++;
+		return;
+	}
+
+	ring->time[idx] = time;
+	memcpy(ring->frames[idx], tp, sizeof(*tp) +
+	       tp->number_of_fingers * sizeof(tp->fingers[0]));
+	smp_store_release(&ring->head, head + 1);
+
+	wake_up_process(applespi->tp_thread);
+}
+
+static int applespi_tp_thread_fn(void *data)
+{
+	struct applespi_data *applespi = data;
+	struct applespi_tp_ring *ring = &applespi->tp_ring;
+	unsigned int tail = ring->tail;
+	unsigned int idx;
+
+	while (true) {
+		set_current_state(TASK_INTERRUPTIBLE);
+
+		if (tail == smp_load_acquire(&ring->head)) {
+			if (kthread_should_stop())
+				break;
+			schedule();
+			continue;
+		}
+
+		__set_current_state(TASK_RUNNING);
+
+		idx = tail % TP_RING_SIZE;
+		applespi_process_tp_frame(applespi,
+			(struct touchpad_protocol *)ring->frames[idx],
+			ring->time[idx]);
+
+		smp_store_release(&ring->tail, ++tail);
+	}
+
+	__set_current_state(TASK_RUNNING);
+
+	return 0;
+}
+
+static int applespi_set_scheduler(struct task_struct *task, int policy,
+				  int prio)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+	/* sched_setscheduler_nocheck() is no longer exported */
+	struct sched_attr attr = {
+		.size		= sizeof(attr),
+		.sched_policy	= policy,
+		.sched_priority	= prio,
+	};
+
+	return sched_setattr_nocheck(task, &attr);
+#else
+	struct sched_param param = { .sched_priority = prio };
+
+	return sched_setscheduler_nocheck(task, policy, &param);
+#endif
+}
+
+static int applespi_tp_thread_start(struct applespi_data *applespi)
+{
+	struct task_struct *task;
+	int policy, prio;
+	int sts;
+
+	if (!tp_thread)
+		return 0;
+
+	switch (tp_thread_policy) {
+	case SCHED_NORMAL:
+	case SCHED_FIFO:
+	case SCHED_RR:
+		policy = tp_thread_policy;
+		break;
+	default:
+		pr_warn("Invalid tp_thread_policy %u, using SCHED_FIFO\n",
+			tp_thread_policy);
+		policy = SCHED_FIFO;
+		break;
+	}
+
+	prio = policy == SCHED_NORMAL ? 0 :
+	       clamp(tp_thread_prio, 1U, MAX_USER_RT_PRIO - 1U);
+
+	task = kthread_create(applespi_tp_thread_fn, applespi, "applespi-tp");
+	if (IS_ERR(task))
+		return PTR_ERR(task);
+
+	sts = applespi_set_scheduler(task, policy, prio);
+	if (sts)
+		pr_warn("Failed to set the touchpad thread's scheduling policy (%d)\n",
+			sts);
+
+	applespi->tp_thread = task;
+	wake_up_process(task);
+
+	return 0;
+}
+
+static void applespi_tp_thread_stop(struct applespi_data *applespi)
+{
+	if (applespi->tp_thread) {
+		kthread_stop(applespi->tp_thread);
+		applespi->tp_thread = NULL;
+	}
+}
+
+static const struct applespi_key_translation *applespi_find_translation(
+		const struct applespi_key_translation *table, u16 key)
+{
+	const struct applespi_key_translation *trans;
+
+	for (trans = table; trans->from; trans++)
+		if (trans->from == key)
+			return trans;
+
+	return NULL;
+}
+
+/*
+ * Apply the fn and iso translations to a keycode the slow way, by looking
+ * it up in the translation tables. This is only used to build the keymaps.
+ */
+static unsigned int applespi_translate_key(struct applespi_data *applespi,
+					   unsigned int key, int fn_pressed)
+{
+	const struct applespi_key_translation *trans;
+
+	if (fnmode) {
+		int do_translate;
+
+		trans = applespi_find_translation(applespi->fn_codes, key);
+		if (trans) {
+			if (trans->flags & APPLE_FLAG_FKEY)
+				do_translate = (fnmode == 2 && fn_pressed) ||
+					       (fnmode == 1 && !fn_pressed);
+			else
+				do_translate = fn_pressed;
+
+			if (do_translate)
+				key = trans->to;
+		}
+	}
+
+	if (iso_layout) {
+		trans = applespi_find_translation(applespi->iso_codes, key);
+		if (trans)
+			key = trans->to;
+	}
+
+	return key;
+}
+
+static void applespi_build_keymaps(struct applespi_data *applespi)
+{
+	u16 (*keymap)[MAX_SCANCODES];
+	unsigned long flags;
+	unsigned int idx;
+	int code;
+
+	spin_lock_irqsave(&applespi->keymap_lock, flags);
+
+	/* read the generation first, so a concurrent change isn't missed */
+	applespi->keymap_gen = READ_ONCE(applespi_keymap_gen);
+
+	idx = !applespi->keymap_idx;
+	keymap = applespi->keymaps[idx];
+
+	for (code = 0; code < MAX_SCANCODES; code++) {
+		keymap[0][code] = applespi_translate_key(applespi,
+						applespi->keycodes[code], 0);
+		keymap[1][code] = applespi_translate_key(applespi,
+						applespi->keycodes[code], 1);
+	}
+
+	smp_store_release(&applespi->keymap_idx, idx);
+
+	spin_unlock_irqrestore(&applespi->keymap_lock, flags);
+}
+
+static unsigned int applespi_code_to_key(struct applespi_data *applespi,
+					 u8 code, int fn_pressed)
+{
+	unsigned int idx;
+
+	/* the keymaps are rebuilt lazily after a parameter change */
+	if (unlikely(applespi->keymap_gen != READ_ONCE(applespi_keymap_gen)))
+		applespi_build_keymaps(applespi);
+
+	idx = smp_load_acquire(&applespi->keymap_idx);
+
+	return applespi->keymaps[idx][!!fn_pressed][code];
+}
+
+/*
+ * Set up the keyboard state: the locking and debouncing, the keycode table,
+ * the translations and the keymaps derived from them. The keyboard self-test
+ * runs the handler on a copy set up by this as well, so anything the handler
+ * relies on should be set up here.
+ */
+static void applespi_init_kbd(struct applespi_data *applespi)
+{
+	int i;
+
+	spin_lock_init(&applespi->kbd_lock);
+	hrtimer_init(&applespi->debounce_timer, CLOCK_MONOTONIC,
+		     HRTIMER_MODE_REL);
+	applespi->debounce_timer.function = applespi_debounce_timer;
+
+	for (i = 0; i < ARRAY_SIZE(applespi_scancodes); i++)
+		applespi->keycodes[i] = applespi_scancodes[i];
+
+	BUILD_BUG_ON(ARRAY_SIZE(applespi_fn_codes) > MAX_FN_CODES + 1);
+	BUILD_BUG_ON(ARRAY_SIZE(apple_iso_keyboard) > MAX_ISO_CODES + 1);
+
+	memcpy(applespi->fn_codes, applespi_fn_codes,
+	       sizeof(applespi_fn_codes));
+	memcpy(applespi->iso_codes, apple_iso_keyboard,
+	       sizeof(apple_iso_keyboard));
+
+	spin_lock_init(&applespi->keymap_lock);
+	applespi_build_keymaps(applespi);
+}
+
+static void applespi_set_keybit(struct applespi_data *applespi,
+				    unsigned int key)
+{
+	const struct applespi_key_translation *trans;
+
+	__set_bit(key, applespi->keyboard_input_dev->keybit);
+
+	trans = applespi_find_translation(applespi->iso_codes, key);
+	if (trans)
+		__set_bit(trans->to, applespi->keyboard_input_dev->keybit);
+}
+
+/*
+ * Set the key capabilities from the keycode table: each keycode, plus
+ * whatever the fn and iso translations may turn it into, regardless of the
+ * current fnmode and iso_layout. Keys currently down stay enabled, so their
+ * release still gets through.
+ *
+ * Must be called with the input device's event_lock held once the device
+ * has been registered.
+ */
+static void applespi_set_keybits(struct applespi_data *applespi)
+{
+	struct input_dev *input = applespi->keyboard_input_dev;
+	const struct applespi_key_translation *trans;
+	unsigned int key;
+	int i;
+
+	bitmap_copy(input->keybit, input->key, KEY_CNT);
+
+	for (i = 0; i < MAX_SCANCODES; i++) {
+		key = applespi->keycodes[i];
+		if (!key)
+			continue;
+
+		applespi_set_keybit(applespi, key);
+
+		trans = applespi_find_translation(applespi->fn_codes, key);
+		if (trans)
+			applespi_set_keybit(applespi, trans->to);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(applespi_controlcodes); i++)
+		if (applespi_controlcodes[i])
+			__set_bit(applespi_controlcodes[i], input->keybit);
+
+	__set_bit(KEY_FN, input->keybit);
+}
+
+static int applespi_getkeycode(struct input_dev *dev,
+			       struct input_keymap_entry *ke)
+{
+	struct applespi_data *applespi = input_get_drvdata(dev);
+	unsigned int scancode;
+
+	if (ke->flags & INPUT_KEYMAP_BY_INDEX)
+		scancode = ke->index;
+	else if (input_scancode_to_scalar(ke, &scancode))
+		return -EINVAL;
+
+	if (scancode >= MAX_SCANCODES)
+		return -EINVAL;
+
+	ke->keycode = applespi->keycodes[scancode];
+	ke->index = scancode;
+	ke->len = sizeof(scancode);
+	memcpy(ke->scancode, &scancode, sizeof(scancode));
+
+	return 0;
+}
+
+/*
+ * Called with the input device's event_lock held. The keycode is changed
+ * under keymap_lock too, as the keymaps may also be rebuilt lazily from the
+ * keyboard path (see applespi_code_to_key()), which doesn't hold event_lock.
+ */
+static int applespi_setkeycode(struct input_dev *dev,
+			       const struct input_keymap_entry *ke,
+			       unsigned int *old_keycode)
+{
+	struct applespi_data *applespi = input_get_drvdata(dev);
+	unsigned int scancode;
+
+	if (ke->flags & INPUT_KEYMAP_BY_INDEX)
+		scancode = ke->index;
+	else if (input_scancode_to_scalar(ke, &scancode))
+		return -EINVAL;
+
+	if (scancode >= MAX_SCANCODES)
+		return -EINVAL;
+
+	spin_lock(&applespi->keymap_lock);
+	*old_keycode = applespi->keycodes[scancode];
+	applespi->keycodes[scancode] = ke->keycode;
+	spin_unlock(&applespi->keymap_lock);
+
+	applespi_build_keymaps(applespi);
+	applespi_set_keybits(applespi);
+
+	return 0;
+}
+
+static ssize_t applespi_show_translations(struct device *dev, char *buf,
+					  bool is_fn)
+{
+	struct applespi_data *applespi = input_get_drvdata(to_input_dev(dev));
+	struct applespi_key_translation table[MAX_FN_CODES + 1];
+	unsigned long flags;
+	ssize_t len = 0;
+	int i;
+
+	BUILD_BUG_ON(MAX_ISO_CODES > MAX_FN_CODES);
+
+	spin_lock_irqsave(&applespi->keymap_lock, flags);
+	if (is_fn)
+		memcpy(table, applespi->fn_codes, sizeof(applespi->fn_codes));
+	else
+		memcpy(table, applespi->iso_codes, sizeof(applespi->iso_codes));
+	spin_unlock_irqrestore(&applespi->keymap_lock, flags);
+
+	for (i = 0; table[i].from; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%u:%u%s\n",
+				 table[i].from, table[i].to,
+				 table[i].flags & APPLE_FLAG_FKEY ? ":f" : "");
+
+	return len;
+}
+
+/*
+ * Parse a list of whitespace-separated "<from>:<to>" entries, where <from>
+ * and <to> are keycodes; if @allow_fkey is set an entry may have a ":f"
+ * suffix, marking it as an fn translation that's subject to fnmode. Returns
+ * the number of entries, or a negative errno.
+ */
+static int applespi_parse_translations(const char *buf,
+				       struct applespi_key_translation *table,
+				       int max, bool allow_fkey)
+{
+	unsigned int from, to;
+	int n = 0, len;
+	u8 flags;
+
+	while (*(buf = skip_spaces(buf))) {
+		if (n >= max)
+			return -E2BIG;
+
+		if (sscanf(buf, "%u:%u%n", &from, &to, &len) != 2)
+			return -EINVAL;
+		buf += len;
+
+		flags = 0;
+		if (allow_fkey && buf[0] == ':' && buf[1] == 'f') {
+			flags = APPLE_FLAG_FKEY;
+			buf += 2;
+		}
+
+		if (*buf && !isspace(*buf))
+			return -EINVAL;
+
+		if (!from || from > KEY_MAX || !to || to > KEY_MAX)
+			return -EINVAL;
+
+		table[n].from = from;
+		table[n].to = to;
+		table[n].flags = flags;
+		n++;
+	}
+
+	memset(&table[n], 0, sizeof(table[n]));
+
+	return n;
+}
+
+/*
+ * Replace a translation table and bring the keymaps and key capabilities up
+ * to date.
+ */
+static ssize_t applespi_store_translations(struct device *dev,
+					   const char *buf, size_t count,
+					   bool is_fn)
+{
+	struct input_dev *input = to_input_dev(dev);
+	struct applespi_data *applespi = input_get_drvdata(input);
+	struct applespi_key_translation *table, *dest;
+	unsigned long flags;
+	int max, n;
+
+	max = is_fn ? MAX_FN_CODES : MAX_ISO_CODES;
+	dest = is_fn ? applespi->fn_codes : applespi->iso_codes;
+
+	table = kcalloc(max + 1, sizeof(*table), GFP_KERNEL);
+	if (!table)
+		return -ENOMEM;
+
+	n = applespi_parse_translations(buf, table, max, is_fn);
+	if (n < 0) {
+		kfree(table);
+		return n;
+	}
+
+	spin_lock_irqsave(&input->event_lock, flags);
+
+	spin_lock(&applespi->keymap_lock);
+	memcpy(dest, table, (n + 1) * sizeof(*table));
+	spin_unlock(&applespi->keymap_lock);
+
+	applespi_build_keymaps(applespi);
+	applespi_set_keybits(applespi);
+
+	spin_unlock_irqrestore(&input->event_lock, flags);
+
+	kfree(table);
+
+	return count;
+}
+
+static ssize_t fn_map_show(struct device *dev, struct device_attribute *attr,
+			   char *buf)
+{
+	return applespi_show_translations(dev, buf, true);
+}
+
+static ssize_t fn_map_store(struct device *dev, struct device_attribute *attr,
+			    const char *buf, size_t count)
+{
+	return applespi_store_translations(dev, buf, count, true);
+}
+
+static DEVICE_ATTR_RW(fn_map);
+
+static ssize_t iso_map_show(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+	return applespi_show_translations(dev, buf, false);
+}
+
+static ssize_t iso_map_store(struct device *dev, struct device_attribute *attr,
+			     const char *buf, size_t count)
+{
+	return applespi_store_translations(dev, buf, count, false);
+}
+
+static DEVICE_ATTR_RW(iso_map);
+
+static struct attribute *applespi_kbd_attrs[] = {
+	&dev_attr_fn_map.attr,
+	&dev_attr_iso_map.attr,
+	NULL
+};
+
+ATTRIBUTE_GROUPS(applespi_kbd);
+
+/* The keyboard handler's usual report callback: the keyboard input device. */
+static void applespi_kbd_event(struct applespi_data *applespi,
+			       unsigned int type, unsigned int code, int value)
+{
+	input_event(applespi->keyboard_input_dev, type, code, value);
+}
+
+/*
+ * Report the keys whose state as last seen from the device (cur_keys_pressed)
+ * differs from what was last reported (last_keys_pressed). If debouncing, a
+ * key whose last reported transition was less than debounce_ms ago is left
+ * alone for now, and the time in ms till it may be reported is returned (the
+ * minimum over all such keys), or 0 if no key is pending. The key events go
+ * to @report.
+ */
+static unsigned int applespi_report_keys(struct applespi_data *applespi,
+					 int fn_pressed, bool debounce,
+					 void (*report)(struct applespi_data *,
+							unsigned int,
+							unsigned int, int))
+{
+	DECLARE_BITMAP(keys_changed, MAX_SCANCODES);
+	unsigned int window = debounce ? READ_ONCE(debounce_ms) : 0;
+	unsigned int elapsed, wait = 0;
+	unsigned int key;
+	u32 now;
+	int i;
+
+	bitmap_xor(keys_changed, applespi->cur_keys_pressed,
+		   applespi->last_keys_pressed, MAX_SCANCODES);
+	if (bitmap_empty(keys_changed, MAX_SCANCODES))
+		return 0;
+
+	now = ktime_to_ms(ktime_get());
+
+	/*
+	 * Report only the keys that changed. A key is released as whatever it
+	 * was translated to when pressed, regardless of the current fn state
+	 * or any keymap changes since.
+	 */
+	for_each_set_bit(i, keys_changed, MAX_SCANCODES) {
+		elapsed = now - applespi->key_transitions[i];
+		if (elapsed < window) {
+			if (!wait || window - elapsed < wait)
+				wait = window - elapsed;
+			continue;
+		}
+
+		if (test_bit(i, applespi->cur_keys_pressed)) {
+			key = applespi_code_to_key(applespi, i, fn_pressed);
+			if (key == KEY_CAPSLOCK)
+				applespi_hold_bulk_cmds(applespi);
+			report(applespi, EV_KEY, key, 1);
+			WRITE_ONCE(applespi->last_typed, ktime_get());
+			applespi->last_keycodes[i] = key;
+			__set_bit(i, applespi->last_keys_pressed);
+		} else {
+			report(applespi, EV_KEY, applespi->last_keycodes[i],
+			       0);
+			__clear_bit(i, applespi->last_keys_pressed);
+		}
+
+		applespi->key_transitions[i] = now;
+	}
+
+	return wait;
+}
+
+/*
+ * (Re)start the debounce timer for keys held back by the debouncing. This is
+ * the only place the timer is started, and it must be called with kbd_lock
+ * held, so starting it from the timer callback and from a new keyboard
+ * packet can't race.
+ */
+static void applespi_arm_debounce(struct applespi_data *applespi,
+				  unsigned int wait)
+{
+	if (wait)
+		hrtimer_start(&applespi->debounce_timer, ms_to_ktime(wait),
+			      HRTIMER_MODE_REL);
+}
+
+static enum hrtimer_restart applespi_debounce_timer(struct hrtimer *timer)
+{
+	struct applespi_data *applespi =
+		container_of(timer, struct applespi_data, debounce_timer);
+	unsigned long flags;
+	unsigned int wait;
+
+	spin_lock_irqsave(&applespi->kbd_lock, flags);
+
+	wait = applespi_report_keys(applespi, applespi->last_fn_pressed, true,
+				    applespi_kbd_event);
+	input_sync(applespi->keyboard_input_dev);
+	applespi_arm_debounce(applespi, wait);
+
+	spin_unlock_irqrestore(&applespi->kbd_lock, flags);
+
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Process a keyboard packet, reporting the resulting key events through
+ * @report (normally applespi_kbd_event()).
+ */
+static void applespi_update_keyboard(struct applespi_data *applespi,
+				     struct keyboard_protocol
+						*keyboard_protocol,
+				     bool debounce,
+				     void (*report)(struct applespi_data *,
+						    unsigned int,
+						    unsigned int, int))
+{
+	DECLARE_BITMAP(keys_pressed, MAX_SCANCODES);
+	DECLARE_BITMAP(keys_changed, MAX_SCANCODES);
+	unsigned int window = debounce ? READ_ONCE(debounce_ms) : 0;
+	unsigned int wait;
+	unsigned long flags;
+	bool is_overflow;
+	u8 modifiers, changed;
+	u8 code;
+	u32 now;
+	int i;
+
+	spin_lock_irqsave(&applespi->kbd_lock, flags);
+
+	/* check for rollover overflow, which is signalled by all keys == 1 */
+	is_overflow = true;
+
+	for (i = 0; i < MAX_ROLLOVER; i++) {
+		if (keyboard_protocol->keys_pressed[i] != 1) {
+			is_overflow = false;
+			break;
+		}
+	}
+
+	/*
+	 * On overflow we don't know which keys are pressed, so keep the last
+	 * known state until the overflow clears; the next regular packet then
+	 * brings everything up to date. The modifiers and fn are still valid,
+	 * though.
+	 */
+	if (is_overflow) {
+		applespi->kbd_overflows++;
+		bitmap_copy(keys_pressed, applespi->cur_keys_pressed,
+			    MAX_SCANCODES);
+	} else {
+		bitmap_zero(keys_pressed, MAX_SCANCODES);
+
+		for (i = 0; i < MAX_ROLLOVER; i++) {
+			code = keyboard_protocol->keys_pressed[i];
+			if (code > 0 && code < ARRAY_SIZE(applespi_scancodes))
+				__set_bit(code, keys_pressed);
+		}
+	}
+
+	/* count the transitions that fall within the debounce window */
+	if (window) {
+		bitmap_xor(keys_changed, keys_pressed,
+			   applespi->cur_keys_pressed, MAX_SCANCODES);
+		now = ktime_to_ms(ktime_get());
+
+		for_each_set_bit(i, keys_changed, MAX_SCANCODES)
+			if (now - applespi->key_transitions[i] < window)
+				applespi->kbd_debounced++;
+	}
+
+	bitmap_copy(applespi->cur_keys_pressed, keys_pressed, MAX_SCANCODES);
+
+	wait = applespi_report_keys(applespi, keyboard_protocol->fn_pressed,
+				    debounce, report);
+
+	/* check control keys */
+	modifiers = keyboard_protocol->modifiers;
+	changed = modifiers ^ applespi->last_modifiers;
+
+	for (i = 0; i < MAX_MODIFIERS; i++) {
+		if ((changed & BIT(i)) && applespi_controlcodes[i])
+			report(applespi, EV_KEY, applespi_controlcodes[i],
+			       !!(modifiers & BIT(i)));
+	}
+
+	/* check function key */
+	if (keyboard_protocol->fn_pressed && !applespi->last_fn_pressed) {
+		report(applespi, EV_KEY, KEY_FN, 1);
+	} else if (!keyboard_protocol->fn_pressed &&
+		   applespi->last_fn_pressed) {
+		report(applespi, EV_KEY, KEY_FN, 0);
+	}
+
+	/* done */
+	report(applespi, EV_SYN, SYN_REPORT, 0);
+
+	applespi->last_modifiers = modifiers;
+	applespi->last_fn_pressed = keyboard_protocol->fn_pressed;
+
+	/* report any keys held back by the debouncing once they're due */
+	applespi_arm_debounce(applespi, wait);
+
+	spin_unlock_irqrestore(&applespi->kbd_lock, flags);
+}
+
+static void applespi_handle_keyboard_event(struct applespi_data *applespi,
+					   struct keyboard_protocol
+							*keyboard_protocol)
+{
+	struct keyboard_protocol *last = &applespi->last_kbd_frame;
+
+	applespi->kbd_frames++;
+
+	/* nothing to do if nothing changed since the last frame */
+	if (applespi->kbd_frame_valid &&
+	    keyboard_protocol->modifiers == last->modifiers &&
+	    keyboard_protocol->fn_pressed == last->fn_pressed &&
+	    !memcmp(keyboard_protocol->keys_pressed, last->keys_pressed,
+		    sizeof(last->keys_pressed))) {
+		applespi->kbd_frames_elided++;
+		return;
+	}
+
+	*last = *keyboard_protocol;
+	applespi->kbd_frame_valid = true;
+
+	applespi_update_keyboard(applespi, keyboard_protocol, true,
+				 applespi_kbd_event);
+}
+
+/*
+ * Release all keys still pressed, e.g. because we won't see their release
+ * while suspended.
+ */
+static void applespi_release_keys(struct applespi_data *applespi)
+{
+	struct keyboard_protocol keyboard_protocol = { 0 };
+
+	hrtimer_cancel(&applespi->debounce_timer);
+	applespi_update_keyboard(applespi, &keyboard_protocol, false,
+				 applespi_kbd_event);
+
+	applespi->kbd_frame_valid = false;
+}
+
+static bool applespi_handle_cmd_response(struct applespi_data *applespi,
+					 struct spi_packet *packet,
+					 struct message *message)
+{
+	/* the touchpad info is the only response carrying a payload */
+	if (packet->device == PACKET_DEV_INFO &&
+	    le16_to_cpu(message->type) == 0x1020)
+		return true;
+
+	if (le16_to_cpu(message->length) != 0x0000) {
+		dev_warn_ratelimited(&applespi->spi->dev,
+				     "Received unexpected write response: length=%x\n",
+				     le16_to_cpu(message->length));
+		return false;
+	}
+
+	return true;
+}
+
+static bool applespi_verify_crc(struct applespi_data *applespi, u8 *buffer,
+				size_t buflen)
+{
+	u16 crc;
+
+	crc = crc16(0, buffer, buflen);
+	if (crc != 0) {
+		dev_warn_ratelimited(&applespi->spi->dev,
+				     "Received corrupted packet (crc mismatch)\n");
+		return false;
+	}
+
+	return true;
+}
+
+static void applespi_debug_print_read_packet(struct applespi_data *applespi,
+					     struct spi_packet *packet)
+{
+	unsigned int dbg_mask;
+
+	if (packet->flags == PACKET_TYPE_READ &&
+	    packet->device == PACKET_DEV_KEYB) {
+		dbg_mask = DBG_RD_KEYB;
+
+	} else if (packet->flags == PACKET_TYPE_READ &&
+		   packet->device == PACKET_DEV_TPAD) {
 		dbg_mask = DBG_RD_TPAD;
 
-	} else if (packet->flags == PACKET_TYPE_WRITE) {
-		dbg_mask = applespi->cmd_log_mask;
+	} else if (packet->flags == PACKET_TYPE_WRITE) {
+		dbg_mask = applespi->cmd_log_mask;
+
+	} else {
+		dbg_mask = DBG_RD_UNKN;
+	}
+
+	debug_print(dbg_mask, "--- %s ---------------------------\n",
+		    applespi_debug_facility(dbg_mask));
+	debug_print_buffer(dbg_mask, "read   ", applespi->rx_buffer,
+			   APPLESPI_PACKET_SIZE);
+}
+
+static void applespi_got_data(struct applespi_data *applespi)
+{
+	struct spi_packet *packet;
+	struct message *message;
+	struct message *rsp = NULL;
+	unsigned int msg_len;
+	unsigned int off;
+	unsigned int rem;
+	unsigned int len;
+
+	/* process packet header */
+	if (!applespi_verify_crc(applespi, applespi->rx_buffer,
+				 APPLESPI_PACKET_SIZE)) {
+		unsigned long flags;
+
+		spin_lock_irqsave(&applespi->cmd_msg_lock, flags);
+
+		applespi->read_active = false;
+
+		if (applespi->drain) {
+			applespi->write_active = false;
+
+			wake_up_all(&applespi->drain_complete);
+		}
+
+		spin_unlock_irqrestore(&applespi->cmd_msg_lock, flags);
+
+		return;
+	}
+
+	packet = (struct spi_packet *)applespi->rx_buffer;
+
+	applespi_debug_print_read_packet(applespi, packet);
+	applespi_raw_log(applespi, RAW_DIR_RX, applespi->rx_buffer);
+
+	off = le16_to_cpu(packet->offset);
+	rem = le16_to_cpu(packet->remaining);
+	len = le16_to_cpu(packet->length);
+
+	if (len > sizeof(packet->data)) {
+		dev_warn_ratelimited(&applespi->spi->dev,
+				     "Received corrupted packet (invalid packet length)\n");
+		goto cleanup;
+	}
+
+	/* handle multi-packet messages */
+	if (rem > 0 || off > 0) {
+		if (off != applespi->saved_msg_len) {
+			dev_warn_ratelimited(&applespi->spi->dev,
+					     "Received unexpected offset (got %u, expected %u)\n",
+					     off, applespi->saved_msg_len);
+			goto cleanup;
+		}
+
+		if (off + rem > MAX_PKTS_PER_MSG * APPLESPI_PACKET_SIZE) {
+			dev_warn_ratelimited(&applespi->spi->dev,
+					     "Received message too large (size %u)\n",
+					     off + rem);
+			goto cleanup;
+		}
+
+		if (off + len > MAX_PKTS_PER_MSG * APPLESPI_PACKET_SIZE) {
+			dev_warn_ratelimited(&applespi->spi->dev,
+					     "Received message too large (size %u)\n",
+					     off + len);
+			goto cleanup;
+		}
+
+		memcpy(applespi->msg_buf + off, &packet->data, len);
+		applespi->saved_msg_len += len;
+
+		if (rem > 0) {
+			/* the read is done, even if the message isn't */
+			applespi_msg_complete(applespi, false, true, NULL);
+			return;
+		}
+
+		message = (struct message *)applespi->msg_buf;
+		msg_len = applespi->saved_msg_len;
+	} else {
+		message = (struct message *)&packet->data;
+		msg_len = len;
+	}
+
+	applespi->saved_msg_len = 0;
+
+	/* got complete message - verify */
+	if (!applespi_verify_crc(applespi, (u8 *)message, msg_len))
+		goto cleanup;
+
+	if (le16_to_cpu(message->length) != msg_len - MSG_HEADER_SIZE - 2) {
+		dev_warn_ratelimited(&applespi->spi->dev,
+				     "Received corrupted packet (invalid message length)\n");
+		goto cleanup;
+	}
+
+	/* handle message */
+	if (packet->flags == PACKET_TYPE_READ &&
+	    packet->device == PACKET_DEV_KEYB) {
+		applespi_handle_keyboard_event(applespi, &message->keyboard);
+
+	} else if (packet->flags == PACKET_TYPE_READ &&
+		   packet->device == PACKET_DEV_TPAD) {
+		struct touchpad_protocol *tp = &message->touchpad;
+
+		size_t tp_len = sizeof(*tp) +
+				tp->number_of_fingers * sizeof(tp->fingers[0]);
+		if (le16_to_cpu(message->length) + 2 != tp_len) {
+			dev_warn_ratelimited(&applespi->spi->dev,
+					     "Received corrupted packet (invalid message length)\n");
+			goto cleanup;
+		}
+
+		if (tp->number_of_fingers > MAX_FINGERS) {
+			dev_warn_ratelimited(&applespi->spi->dev,
+					     "Number of reported fingers (%u) exceeds max (%u))\n",
+					     tp->number_of_fingers,
+					     MAX_FINGERS);
+			tp->number_of_fingers = MAX_FINGERS;
+		}
+
+		if (applespi->tp_thread)
+			applespi_queue_tp_frame(applespi, tp,
+						applespi->read_start);
+		else
+			applespi_process_tp_frame(applespi, tp,
+						  applespi->read_start);
+
+	} else if (packet->flags == PACKET_TYPE_WRITE) {
+		if (applespi_handle_cmd_response(applespi, packet, message))
+			rsp = message;
+	}
+
+cleanup:
+	/*
+	 * Note: this relies on the fact that we are blocking the processing of
+	 * spi messages at this point, i.e. that no further transfers or cs
+	 * changes are processed while we delay here.
+	 */
+	udelay(SPI_RW_CHG_DLY);
+
+	/* clean up */
+	applespi_msg_complete(applespi, packet->flags == PACKET_TYPE_WRITE,
+			      true, rsp);
+}
+
+static void applespi_async_read_complete(void *context)
+{
+	struct applespi_data *applespi = context;
+
+	if (applespi->rd_m.status < 0) {
+		pr_warn("Error reading from device: %d\n",
+			applespi->rd_m.status);
+		applespi_msg_complete(applespi, false, true, NULL);
+	} else {
+		applespi_got_data(applespi);
+	}
+
+	acpi_finish_gpe(NULL, applespi->gpe);
+}
+
+static u32 applespi_notify(acpi_handle gpe_device, u32 gpe, void *context)
+{
+	struct applespi_data *applespi = context;
+	int sts;
+	unsigned long flags;
+
+	debug_print(DBG_RD_IRQ, "--- %s ---------------------------\n",
+		    applespi_debug_facility(DBG_RD_IRQ));
+
+	spin_lock_irqsave(&applespi->cmd_msg_lock, flags);
+
+	sts = applespi_async(applespi, &applespi->rd_m,
+			     applespi_async_read_complete);
+	if (sts != 0) {
+		pr_warn("Error queueing async read to device: %d\n", sts);
+	} else {
+		applespi->read_active = true;
+		applespi->read_start = ktime_get();
+		applespi_arm_watchdog(applespi);
+	}
+
+	spin_unlock_irqrestore(&applespi->cmd_msg_lock, flags);
+
+	return ACPI_INTERRUPT_HANDLED;
+}
+
+static int applespi_raw_open(struct inode *inode, struct file *file)
+{
+	struct applespi_raw *raw = container_of(file->private_data,
+						struct applespi_raw, misc);
+	int sts = 0;
+
+	mutex_lock(&raw->lock);
+
+	if (!raw->applespi) {
+		sts = -ENODEV;
+	} else if (raw->open) {
+		sts = -EBUSY;
+	} else {
+		/* start with an empty ring */
+		raw->ring->tail = smp_load_acquire(&raw->ring->head);
+		WRITE_ONCE(raw->open, true);
+		file->private_data = raw;
+	}
+
+	mutex_unlock(&raw->lock);
+
+	if (sts)
+		return sts;
+
+	return nonseekable_open(inode, file);
+}
+
+static void applespi_raw_free(struct applespi_raw *raw)
+{
+	vfree(raw->ring);
+	kfree(raw);
+}
+
+static int applespi_raw_release(struct inode *inode, struct file *file)
+{
+	struct applespi_raw *raw = file->private_data;
+	bool gone;
+
+	mutex_lock(&raw->lock);
+
+	WRITE_ONCE(raw->open, false);
+	gone = !raw->applespi;
+
+	mutex_unlock(&raw->lock);
+
+	if (gone)
+		applespi_raw_free(raw);
+
+	return 0;
+}
+
+static __poll_t applespi_raw_poll(struct file *file, poll_table *wait)
+{
+	struct applespi_raw *raw = file->private_data;
+	__poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+	poll_wait(file, &raw->wait, wait);
+
+	if (smp_load_acquire(&raw->ring->head) != READ_ONCE(raw->ring->tail))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (!READ_ONCE(raw->applespi))
+		mask |= EPOLLHUP;
+
+	return mask;
+}
+
+static int applespi_raw_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct applespi_raw *raw = file->private_data;
+
+	if (vma->vm_pgoff ||
+	    vma->vm_end - vma->vm_start > PAGE_ALIGN(raw->ring_size))
+		return -EINVAL;
+
+	return remap_vmalloc_range(vma, raw->ring, 0);
+}
+
+/*
+ * Send a command through the regular command queue. The data written must be
+ * a complete message, minus the crc, of one of the known command types; only
+ * the type and the payload are used, the remaining header fields are filled
+ * in by the driver. The response shows up in the ring.
+ */
+static ssize_t applespi_raw_write(struct file *file, const char __user *buf,
+				  size_t count, loff_t *ppos)
+{
+	struct applespi_raw *raw = file->private_data;
+	const struct applespi_cmd_type *type = NULL;
+	struct applespi_cmd cmd;
+	struct message msg;
+	int i, sts;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	if (count < MSG_HEADER_SIZE || count > sizeof(msg))
+		return -EINVAL;
+
+	if (copy_from_user(&msg, buf, count))
+		return -EFAULT;
+
+	for (i = 0; i < APPLESPI_CMD_NR; i++) {
+		if (le16_to_cpu(msg.type) == applespi_cmd_types[i].msg_type &&
+		    count == MSG_HEADER_SIZE +
+			     applespi_cmd_types[i].msg_len - 2) {
+			type = &applespi_cmd_types[i];
+			break;
+		}
+	}
+	if (!type)
+		return -EINVAL;
+
+	mutex_lock(&raw->lock);
+
+	if (raw->applespi) {
+		applespi_init_cmd(&cmd, i, NULL);
+		memcpy(cmd.data, msg.data, type->msg_len - 2);
+
+		sts = applespi_send_cmd_sync(raw->applespi, &cmd, NULL, 0,
+					     CMD_SYNC_TIMEOUT);
+	} else {
+		sts = -ENODEV;
+	}
+
+	mutex_unlock(&raw->lock);
+
+	return sts < 0 ? sts : count;
+}
+
+static const struct file_operations applespi_raw_fops = {
+	.owner		= THIS_MODULE,
+	.open		= applespi_raw_open,
+	.release	= applespi_raw_release,
+	.poll		= applespi_raw_poll,
+	.mmap		= applespi_raw_mmap,
+	.write		= applespi_raw_write,
+};
+
+static int applespi_raw_create(struct applespi_data *applespi)
+{
+	struct applespi_raw *raw;
+	int sts;
+
+	raw = kzalloc(sizeof(*raw), GFP_KERNEL);
+	if (!raw)
+		return -ENOMEM;
+
+	raw->ring_size = PAGE_SIZE +
+			 RAW_RING_RECORDS * sizeof(struct applespi_raw_record);
+	raw->ring = vmalloc_user(raw->ring_size);
+	if (!raw->ring) {
+		kfree(raw);
+		return -ENOMEM;
+	}
+
+	raw->ring->version = RAW_RING_VERSION;
+	raw->ring->nr_records = RAW_RING_RECORDS;
+	raw->ring->record_size = sizeof(struct applespi_raw_record);
+	raw->ring->data_offset = PAGE_SIZE;
+
+	mutex_init(&raw->lock);
+	spin_lock_init(&raw->prod_lock);
+	init_waitqueue_head(&raw->wait);
+	raw->applespi = applespi;
+
+	raw->misc.minor = MISC_DYNAMIC_MINOR;
+	raw->misc.name = "applespi-raw";
+	raw->misc.fops = &applespi_raw_fops;
+	raw->misc.parent = &applespi->spi->dev;
+	raw->misc.mode = 0600;
+
+	sts = misc_register(&raw->misc);
+	if (sts) {
+		applespi_raw_free(raw);
+		return sts;
+	}
+
+	applespi->raw = raw;
+
+	return 0;
+}
+
+static void applespi_raw_destroy(struct applespi_data *applespi)
+{
+	struct applespi_raw *raw = applespi->raw;
+	bool gone;
+
+	if (!raw)
+		return;
+
+	/* this also waits for any open() in progress */
+	misc_deregister(&raw->misc);
+
+	mutex_lock(&raw->lock);
+
+	raw->applespi = NULL;
+	gone = !raw->open;
+
+	mutex_unlock(&raw->lock);
+
+	applespi->raw = NULL;
+	wake_up_interruptible(&raw->wait);
+
+	if (gone)
+		applespi_raw_free(raw);
+}
+
+#ifdef CONFIG_APPLESPI_SELFTEST
+/*
+ * The straightforward way of building a command packet, as done before the
+ * templates were introduced; only used to verify and benchmark the former.
+ */
+static void applespi_build_cmd_slow(const struct applespi_cmd *cmd,
+				    u8 counter, u8 *buf)
+{
+	struct spi_packet *packet = (struct spi_packet *)buf;
+	struct message *message = (struct message *)packet->data;
+	u16 msg_len = cmd->type->msg_len;
+	u16 crc;
+
+	memset(packet, 0, APPLESPI_PACKET_SIZE);
+
+	message->type = cpu_to_le16(cmd->type->msg_type);
+	memcpy(message->data, cmd->data, msg_len - 2);
+
+	packet->flags = PACKET_TYPE_WRITE;
+	packet->device = cmd->type->device;
+	packet->length = cpu_to_le16(MSG_HEADER_SIZE + msg_len);
+
+	message->zero = cmd->type->zero;
+	message->counter = counter;
+
+	message->length = cpu_to_le16(msg_len - 2);
+	if (cmd->type->rsp_buf_len)
+		message->rsp_buf_len = cpu_to_le16(cmd->type->rsp_buf_len);
+	else
+		message->rsp_buf_len = message->length;
+
+	crc = crc16(0, (u8 *)message, le16_to_cpu(packet->length) - 2);
+	*((__le16 *)&message->data[msg_len - 2]) = cpu_to_le16(crc);
+
+	crc = crc16(0, (u8 *)packet, sizeof(*packet) - 2);
+	packet->crc_16 = cpu_to_le16(crc);
+}
+
+/*
+ * Build each type of command many times, both from the template and the
+ * slow way, and report the time per build and whether the results match.
+ */
+static int applespi_cmd_build_bench_show(struct seq_file *s, void *unused)
+{
+	struct applespi_data *applespi = s->private;
+	struct applespi_cmd cmd;
+	u64 slow_ns, tmpl_ns, start;
+	u8 *slow_buf, *tmpl_buf;
+	int i, n;
+
+	slow_buf = kmalloc(2 * APPLESPI_PACKET_SIZE, GFP_KERNEL);
+	if (!slow_buf)
+		return -ENOMEM;
+	tmpl_buf = slow_buf + APPLESPI_PACKET_SIZE;
+
+	for (i = 0; i < APPLESPI_CMD_NR; i++) {
+		applespi_init_cmd(&cmd, i, NULL);
+		get_random_bytes(cmd.data, cmd.type->msg_len - 2);
+
+		start = ktime_get_ns();
+		for (n = 0; n < CMD_BUILD_BENCH_ITERS; n++)
+			applespi_build_cmd_slow(&cmd, n & 0xff, slow_buf);
+		slow_ns = ktime_get_ns() - start;
+
+		start = ktime_get_ns();
+		for (n = 0; n < CMD_BUILD_BENCH_ITERS; n++)
+			applespi_build_cmd(applespi, &cmd, n & 0xff, tmpl_buf);
+		tmpl_ns = ktime_get_ns() - start;
+
+		seq_printf(s, "%-24s slow: %llu ns  template: %llu ns  %s\n",
+			   applespi_debug_facility(cmd.type->log_mask),
+			   div_u64(slow_ns, CMD_BUILD_BENCH_ITERS),
+			   div_u64(tmpl_ns, CMD_BUILD_BENCH_ITERS),
+			   memcmp(slow_buf, tmpl_buf, APPLESPI_PACKET_SIZE) ?
+				"MISMATCH" : "ok");
+	}
+
+	kfree(slow_buf);
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(applespi_cmd_build_bench);
+
+/*
+ * Translate the keys of many random keyboard packets, both from the keymaps
+ * and the slow way, and report the time per packet (each key being looked up
+ * once for the press and once for the release) and whether the keymaps match
+ * the translation tables.
+ */
+static int applespi_keymap_bench_show(struct seq_file *s, void *unused)
+{
+	struct applespi_data *applespi = s->private;
+	u8 keys[256 + MAX_ROLLOVER];
+	u64 slow_ns, map_ns, start;
+	unsigned int sum = 0;
+	bool match = true;
+	int i, n, fn;
+	u8 code;
+
+	get_random_bytes(keys, sizeof(keys));
+
+	start = ktime_get_ns();
+	for (n = 0; n < KEYMAP_BENCH_ITERS; n++) {
+		for (i = 0; i < MAX_ROLLOVER; i++) {
+			code = keys[n % 256 + i];
+			sum += applespi_translate_key(applespi,
+						      applespi->keycodes[code],
+						      n & 1);
+			sum += applespi_translate_key(applespi,
+						      applespi->keycodes[code],
+						      n & 1);
+		}
+	}
+	slow_ns = ktime_get_ns() - start;
+
+	start = ktime_get_ns();
+	for (n = 0; n < KEYMAP_BENCH_ITERS; n++) {
+		for (i = 0; i < MAX_ROLLOVER; i++) {
+			code = keys[n % 256 + i];
+			sum -= applespi_code_to_key(applespi, code, n & 1);
+			sum -= applespi_code_to_key(applespi, code, n & 1);
+		}
+	}
+	map_ns = ktime_get_ns() - start;
+
+	for (fn = 0; fn < 2; fn++)
+		for (i = 0; i < MAX_SCANCODES; i++)
+			if (applespi_code_to_key(applespi, i, fn) !=
+			    applespi_translate_key(applespi,
+						   applespi->keycodes[i], fn))
+				match = false;
+
+	seq_printf(s, "keyboard packet  slow: %llu ns  keymap: %llu ns  %s\n",
+		   div_u64(slow_ns, KEYMAP_BENCH_ITERS),
+		   div_u64(map_ns, KEYMAP_BENCH_ITERS),
+		   match && !sum ? "ok" : "MISMATCH");
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(applespi_keymap_bench);
+
+/**
+ * struct applespi_kbd_fuzz - the keyboard fuzzer's private keyboard state and
+ * the key events recorded from it.
+ *
+ * @kbd:	the keyboard state the packets are played through
+ * @down:	number of presses not yet released, per key (a key may be
+ *		pressed through two scancodes, e.g. delete and fn+backspace)
+ * @presses:	number of key presses seen
+ * @releases:	number of key releases seen
+ * @errors:	number of releases of keys that weren't down
+ */
+struct applespi_kbd_fuzz {
+	struct applespi_data	kbd;
+	u8			down[KEY_CNT];
+	u32			presses;
+	u32			releases;
+	u32			errors;
+};
 
+/* The keyboard fuzzer's report callback, recording the key events. */
+static void applespi_kbd_fuzz_event(struct applespi_data *applespi,
+				    unsigned int type, unsigned int code,
+				    int value)
+{
+	struct applespi_kbd_fuzz *fuzz =
+		container_of(applespi, struct applespi_kbd_fuzz, kbd);
+
+	if (type != EV_KEY)
+		return;
+
+	if (value) {
+		fuzz->down[code]++;
+		fuzz->presses++;
+	} else if (fuzz->down[code]) {
+		fuzz->down[code]--;
+		fuzz->releases++;
 	} else {
-		dbg_mask = DBG_RD_UNKN;
+		fuzz->errors++;
 	}
+}
 
-	debug_print(dbg_mask, "--- %s ---------------------------\n",
-		    applespi_debug_facility(dbg_mask));
-	debug_print_buffer(dbg_mask, "read   ", applespi->rx_buffer,
-			   APPLESPI_PACKET_SIZE);
+/*
+ * Play random keyboard packets through the keyboard handler, on a private copy
+ * of the keyboard state whose key events are recorded instead of reported:
+ * alternating phases of fast typing with a few keys down and of chords of up
+ * to KBD_FUZZ_MAX_HELD keys (more than the keyboard can report, so with
+ * overflow packets), with random modifier and fn changes. Once all keys have
+ * been let go, every press must have been matched by exactly one release.
+ * This exercises the rollover handling, not the debouncing.
+ */
+static int applespi_kbd_fuzz_show(struct seq_file *s, void *unused)
+{
+	struct keyboard_protocol kp = { 0 };
+	struct applespi_kbd_fuzz *fuzz;
+	struct applespi_data *kbd;
+	u8 held[KBD_FUZZ_MAX_HELD];
+	int n, i, nheld = 0, max_held;
+	unsigned int stuck = 0;
+	u8 rnd[4], code;
+
+	fuzz = kzalloc(sizeof(*fuzz), GFP_KERNEL);
+	if (!fuzz)
+		return -ENOMEM;
+
+	kbd = &fuzz->kbd;
+	applespi_init_kbd(kbd);
+	/* taken on caps-lock, see applespi_hold_bulk_cmds() */
+	spin_lock_init(&kbd->cmd_msg_lock);
+
+	for (n = 0; n < KBD_FUZZ_FRAMES; n++) {
+		get_random_bytes(rnd, sizeof(rnd));
+		max_held = (n / 1000) & 1 ? KBD_FUZZ_MAX_HELD : 3;
+
+		if ((rnd[0] & 1) && nheld < max_held) {
+			code = 1 + rnd[1] %
+				   (ARRAY_SIZE(applespi_scancodes) - 1);
+			for (i = 0; i < nheld && held[i] != code; i++)
+				;
+			if (i == nheld)
+				held[nheld++] = code;
+		} else if (nheld) {
+			i = rnd[1] % nheld;
+			held[i] = held[--nheld];
+		}
+
+		if (rnd[2] < 16)
+			kp.modifiers ^= BIT(rnd[2] % MAX_MODIFIERS);
+		if (rnd[3] < 8)
+			kp.fn_pressed = !kp.fn_pressed;
+
+		/* the keyboard reports the keys in no particular order */
+		for (i = 0; i < MAX_ROLLOVER; i++) {
+			if (nheld > MAX_ROLLOVER)
+				kp.keys_pressed[i] = 1;
+			else if (i < nheld)
+				kp.keys_pressed[i] =
+					held[(i + rnd[3]) % nheld];
+			else
+				kp.keys_pressed[i] = 0;
+		}
+
+		applespi_update_keyboard(kbd, &kp, false,
+					 applespi_kbd_fuzz_event);
+
+		cond_resched();
+	}
+
+	memset(&kp, 0, sizeof(kp));
+	applespi_update_keyboard(kbd, &kp, false, applespi_kbd_fuzz_event);
+
+	for (i = 0; i < KEY_CNT; i++)
+		if (fuzz->down[i])
+			stuck++;
+
+	seq_printf(s, "frames=%u overflows=%u presses=%u releases=%u errors=%u stuck=%u  %s\n",
+		   KBD_FUZZ_FRAMES, kbd->kbd_overflows, fuzz->presses,
+		   fuzz->releases, fuzz->errors, stuck,
+		   fuzz->errors || stuck || fuzz->presses != fuzz->releases ?
+			"FAIL" : "ok");
+
+	kfree(fuzz);
+
+	return 0;
 }
 
-static void applespi_got_data(struct applespi_data *applespi)
+DEFINE_SHOW_ATTRIBUTE(applespi_kbd_fuzz);
+
+/*
+ * Assign slots for 1 to MAX_FINGERS contacts moving about randomly, both by
+ * position and by order, and report the time per frame. This uses a private,
+ * unregistered input device, as input_mt_assign_slots() must not run
+ * concurrently with the touchpad's own frames; its slots are filled in
+ * directly, since an unregistered device can't process events.
+ */
+static int applespi_tp_track_bench_show(struct seq_file *s, void *unused)
 {
-	struct spi_packet *packet;
-	struct message *message;
-	unsigned int msg_len;
-	unsigned int off;
-	unsigned int rem;
-	unsigned int len;
+	struct applespi_data *applespi = s->private;
+	const struct applespi_tp_info *tp_info = &applespi->tp_info;
+	struct input_mt_pos pos[MAX_FINGERS];
+	struct applespi_tp_track track;
+	int slots[MAX_FINGERS];
+	struct input_mt_slot *slot;
+	struct input_dev *input;
+	u64 pos_ns, order_ns, start;
+	u8 jitter[2 * MAX_FINGERS];
+	int i, j, n, sts;
+
+	input = input_allocate_device();
+	if (!input)
+		return -ENOMEM;
 
-	/* process packet header */
-	if (!applespi_verify_crc(applespi, applespi->rx_buffer,
-				 APPLESPI_PACKET_SIZE)) {
-		unsigned long flags;
+	input_set_abs_params(input, ABS_MT_POSITION_X,
+			     tp_info->x_min, tp_info->x_max, 0, 0);
+	input_set_abs_params(input, ABS_MT_POSITION_Y,
+			     tp_info->y_min, tp_info->y_max, 0, 0);
+
+	sts = input_mt_init_slots(input, MAX_FINGERS,
+				  INPUT_MT_POINTER | INPUT_MT_TRACK);
+	if (sts) {
+		input_free_device(input);
+		return sts;
+	}
+
+	for (n = 1; n <= MAX_FINGERS; n++) {
+		/* set up n contacts spread over the touchpad */
+		for (i = 0; i < n; i++) {
+			pos[i].x = tp_info->x_min + (i + 1) *
+				   (tp_info->x_max - tp_info->x_min) / (n + 1);
+			pos[i].y = (tp_info->y_min + tp_info->y_max) / 2;
+
+			slot = &input->mt->slots[i];
+			input_mt_set_value(slot, ABS_MT_TRACKING_ID, i);
+			input_mt_set_value(slot, ABS_MT_POSITION_X, pos[i].x);
+			input_mt_set_value(slot, ABS_MT_POSITION_Y, pos[i].y);
+
+			track.pos[i] = pos[i];
+			track.slots[i] = i;
+		}
+		track.n = n;
+
+		pos_ns = 0;
+		order_ns = 0;
+
+		for (j = 0; j < TP_TRACK_BENCH_ITERS; j++) {
+			get_random_bytes(jitter, sizeof(jitter));
+			for (i = 0; i < n; i++) {
+				pos[i].x = track.pos[i].x + jitter[2 * i] - 128;
+				pos[i].y = track.pos[i].y +
+					   jitter[2 * i + 1] - 128;
+			}
+
+			start = ktime_get_ns();
+			input_mt_assign_slots(input, slots, pos, n, 0);
+			pos_ns += ktime_get_ns() - start;
+
+			start = ktime_get_ns();
+			applespi_track_by_order(&track, pos, slots, n);
+			order_ns += ktime_get_ns() - start;
+		}
+
+		seq_printf(s, "%2d fingers  by position: %llu ns  by order: %llu ns\n",
+			   n, div_u64(pos_ns, TP_TRACK_BENCH_ITERS),
+			   div_u64(order_ns, TP_TRACK_BENCH_ITERS));
+	}
+
+	input_free_device(input);
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(applespi_tp_track_bench);
+
+/*
+ * Decode touchpad frames with 1, 5 and 11 contacts spread over the touchpad,
+ * with palm rejection enabled, and report the time per frame.
+ */
+static int applespi_tp_decode_bench_show(struct seq_file *s, void *unused)
+{
+	static const int counts[] = { 1, 5, MAX_FINGERS };
+	struct applespi_data *applespi = s->private;
+	const struct applespi_tp_info *tp_info = &applespi->tp_info;
+	struct applespi_tp_palms palms = { 0 };
+	struct applespi_tp_contacts *c;
+	struct touchpad_protocol *t;
+	struct tp_finger *f;
+	u64 ns, start;
+	int i, j, n;
+
+	t = kzalloc(TP_FRAME_MAX_LEN, GFP_KERNEL);
+	c = kzalloc(sizeof(*c), GFP_KERNEL);
+	if (!t || !c) {
+		kfree(t);
+		kfree(c);
+		return -ENOMEM;
+	}
+
+	for (j = 0; j < ARRAY_SIZE(counts); j++) {
+		n = counts[j];
+		t->number_of_fingers = n;
+
+		for (i = 0; i < n; i++) {
+			f = &t->fingers[i];
+			f->abs_x = cpu_to_le16(tp_info->x_min + (i + 1) *
+					       (tp_info->x_max -
+						tp_info->x_min) / (n + 1));
+			f->abs_y = cpu_to_le16((tp_info->y_min +
+						tp_info->y_max) / 2);
+			f->touch_major = cpu_to_le16(200 + i);
+			f->touch_minor = cpu_to_le16(180 + i);
+			f->tool_major = cpu_to_le16(300 + i);
+			f->tool_minor = cpu_to_le16(280 + i);
+			f->orientation = cpu_to_le16(MAX_FINGER_ORIENTATION);
+			f->pressure = cpu_to_le16(100 + i);
+		}
+
+		start = ktime_get_ns();
+		for (i = 0; i < TP_DECODE_BENCH_ITERS; i++)
+			applespi_decode_contacts(tp_info, t, c, &palms);
+		ns = ktime_get_ns() - start;
+
+		seq_printf(s, "%2d fingers: %llu ns\n", n,
+			   div_u64(ns, TP_DECODE_BENCH_ITERS));
+	}
+
+	kfree(t);
+	kfree(c);
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(applespi_tp_decode_bench);
+#endif
+
+static unsigned int applespi_percent(u32 part, u32 total)
+{
+	return total ? div_u64((u64)part * 100, total) : 0;
+}
+
+static int applespi_frame_stats_show(struct seq_file *s, void *unused)
+{
+	struct applespi_data *applespi = s->private;
+	u32 frames, elided, idle;
+
+	frames = READ_ONCE(applespi->kbd_frames);
+	elided = READ_ONCE(applespi->kbd_frames_elided);
+	seq_printf(s, "keyboard: frames=%u elided=%u (%u%%)\n", frames, elided,
+		   applespi_percent(elided, frames));
+
+	frames = READ_ONCE(applespi->tp_frames);
+	elided = READ_ONCE(applespi->tp_frames_elided);
+	idle = READ_ONCE(applespi->tp_frames_idle);
+	seq_printf(s, "touchpad: frames=%u elided=%u (%u%%) idle=%u (%u%%)\n",
+		   frames, elided, applespi_percent(elided, frames), idle,
+		   applespi_percent(idle, frames));
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(applespi_frame_stats);
+
+static const char *const applespi_prio_names[APPLESPI_PRIO_NR] = {
+	[APPLESPI_PRIO_BULK]		= "bulk",
+	[APPLESPI_PRIO_INTERACTIVE]	= "interactive",
+	[APPLESPI_PRIO_CONTROL]		= "control",
+};
+
+static int applespi_cmd_latency_show(struct seq_file *s, void *unused)
+{
+	struct applespi_data *applespi = s->private;
+	struct applespi_cmd_stats stats;
+	unsigned long flags;
+	int prio, i;
+
+	for (prio = APPLESPI_PRIO_NR - 1; prio >= 0; prio--) {
+		spin_lock_irqsave(&applespi->cmd_msg_lock, flags);
+		stats = applespi->cmd_stats[prio];
+		spin_unlock_irqrestore(&applespi->cmd_msg_lock, flags);
+
+		seq_printf(s, "%s: count=%u avg=%lluus max=%uus",
+			   applespi_prio_names[prio], stats.count,
+			   stats.count ?
+				div_u64(stats.total_us, stats.count) : 0,
+			   stats.max_us);
+		if (prio == APPLESPI_PRIO_INTERACTIVE)
+			seq_printf(s, " over_target=%u", stats.missed);
+		seq_puts(s, "\n");
+
+		for (i = 0; i < CMD_LAT_BUCKETS; i++) {
+			if (!stats.hist[i])
+				continue;
+			if (i < CMD_LAT_BUCKETS - 1)
+				seq_printf(s, "  < %7luus: %u\n", BIT(i),
+					   stats.hist[i]);
+			else
+				seq_printf(s, "  >=%7luus: %u\n", BIT(i - 1),
+					   stats.hist[i]);
+		}
+	}
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(applespi_cmd_latency);
+
+static int applespi_tp_delay_show(struct seq_file *s, void *unused)
+{
+	struct applespi_data *applespi = s->private;
+	struct applespi_tp_delay_stats stats = applespi->tp_delay;
+	u64 mean = 0, var = 0;
+	int i;
+
+	if (stats.count) {
+		mean = div_u64(stats.total_us, stats.count);
+		var = div_u64(stats.total_sq_us, stats.count);
+		var = var > mean * mean ? var - mean * mean : 0;
+	}
+
+	seq_printf(s, "count=%u avg=%lluus jitter=%luus max=%uus\n",
+		   stats.count, mean, int_sqrt(var), stats.max_us);
+
+	for (i = 0; i < CMD_LAT_BUCKETS; i++) {
+		if (!stats.hist[i])
+			continue;
+		if (i < CMD_LAT_BUCKETS - 1)
+			seq_printf(s, "  < %7luus: %u\n", BIT(i),
+				   stats.hist[i]);
+		else
+			seq_printf(s, "  >=%7luus: %u\n", BIT(i - 1),
+				   stats.hist[i]);
+	}
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(applespi_tp_delay);
+
+
+static void applespi_tp_info_complete(struct applespi_data *applespi,
+				      struct applespi_cmd *cmd, int status,
+				      const struct message *rsp)
+{
+	if (!status && le16_to_cpu(rsp->length) <
+			offsetof(struct touchpad_info_protocol, unknown2))
+		status = -EIO;
+
+	if (!status) {
+		applespi->tp_model_no = rsp->tp_info.model_no;
+		applespi->tp_model_flags = rsp->tp_info.model_flags;
+	}
+
+	applespi->tp_info_status = status;
+
+	/* nothing gets set up anymore once we're going away */
+	if (!applespi->drain)
+		mod_delayed_work(system_wq, &applespi->tp_setup_work, 0);
+}
+
+/*
+ * Query the touchpad for its model number, which determines its dimensions.
+ * Requires the GPE to be set up, as the response is read like any other.
+ * Rather than having probe wait for the response, the touchpad is set up
+ * once it arrives, or after TP_INFO_TIMEOUT ms without it.
+ */
+static void applespi_query_tp_info(struct applespi_data *applespi)
+{
+	unsigned long flags;
+
+	applespi->tp_info_status = -ETIMEDOUT;
+	schedule_delayed_work(&applespi->tp_setup_work,
+			      msecs_to_jiffies(TP_INFO_TIMEOUT));
+
+	spin_lock_irqsave(&applespi->cmd_msg_lock, flags);
+	applespi_queue_cmd(applespi, &applespi->tp_info_cmd);
+	spin_unlock_irqrestore(&applespi->cmd_msg_lock, flags);
+}
+
+static int applespi_setup_scroll(struct applespi_data *applespi)
+{
+	struct input_dev *scroll_input_dev;
+	int result;
+
+	scroll_input_dev = devm_input_allocate_device(&applespi->spi->dev);
+
+	if (!scroll_input_dev)
+		return -ENOMEM;
+
+	scroll_input_dev->name = "Apple SPI Touchpad Scroll";
+	scroll_input_dev->phys = "applespi/input2";
+	scroll_input_dev->dev.parent = &applespi->spi->dev;
+	scroll_input_dev->id.bustype = BUS_SPI;
+
+	input_set_capability(scroll_input_dev, EV_REL, REL_WHEEL);
+	input_set_capability(scroll_input_dev, EV_REL, REL_HWHEEL);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+	input_set_capability(scroll_input_dev, EV_REL, REL_WHEEL_HI_RES);
+	input_set_capability(scroll_input_dev, EV_REL, REL_HWHEEL_HI_RES);
+#endif
+
+	result = input_register_device(scroll_input_dev);
+	if (result) {
+		pr_err("Unabled to register scroll input device (%d)\n",
+		       result);
+		return -ENODEV;
+	}
+
+	applespi->tp_scroll.input = scroll_input_dev;
+
+	return 0;
+}
+
+/*
+ * A force click is reported as a key on a device of its own: a clickpad
+ * mustn't have any buttons other than BTN_LEFT, and as a separate key it can
+ * be bound to an action of its own rather than showing up as a chord with
+ * the click it follows.
+ */
+static int applespi_setup_force_click(struct applespi_data *applespi)
+{
+	struct input_dev *force_click_input_dev;
+	int result;
+
+	force_click_input_dev = devm_input_allocate_device(&applespi->spi->dev);
+
+	if (!force_click_input_dev)
+		return -ENOMEM;
+
+	force_click_input_dev->name = "Apple SPI Touchpad Force Click";
+	force_click_input_dev->phys = "applespi/input3";
+	force_click_input_dev->dev.parent = &applespi->spi->dev;
+	force_click_input_dev->id.bustype = BUS_SPI;
+
+	input_set_capability(force_click_input_dev, EV_KEY, KEY_PROG1);
+
+	result = input_register_device(force_click_input_dev);
+	if (result) {
+		pr_err("Unabled to register force click input device (%d)\n",
+		       result);
+		return -ENODEV;
+	}
+
+	applespi->force_click_input_dev = force_click_input_dev;
+
+	return 0;
+}
+
+static int applespi_setup_touchpad(struct applespi_data *applespi,
+				   int info_sts)
+{
+	const struct applespi_tp_model_info *info;
+	struct applespi_tp_info *tp_info = NULL;
+	struct input_dev *touchpad_input_dev;
+	int result;
+
+	/*
+	 * set up touchpad dimensions: preferably by the model the touchpad
+	 * reports, else by DMI, unless overridden by the user
+	 */
+	if (info_sts) {
+		pr_warn("Failed to get touchpad info (%d) - using DMI\n",
+			info_sts);
+	} else {
+		pr_info("Touchpad model %#04x (flags %#04x)\n",
+			applespi->tp_model_no, applespi->tp_model_flags);
 
-		spin_lock_irqsave(&applespi->cmd_msg_lock, flags);
+		for (info = applespi_tp_models; info->model; info++) {
+			if (info->model == applespi->tp_model_no) {
+				tp_info = info->tp_info;
+				break;
+			}
+		}
 
-		if (applespi->drain) {
-			applespi->read_active = false;
-			applespi->write_active = false;
+		if (!tp_info)
+			pr_warn("Unknown touchpad model - using DMI\n");
+	}
 
-			wake_up_all(&applespi->drain_complete);
-		}
+	if (!tp_info)
+		tp_info = dmi_first_match(applespi_touchpad_infos)->driver_data;
 
-		spin_unlock_irqrestore(&applespi->cmd_msg_lock, flags);
+	applespi->tp_info = *tp_info;
 
-		return;
+	if (touchpad_dimensions[0] || touchpad_dimensions[1] ||
+	    touchpad_dimensions[2] || touchpad_dimensions[3]) {
+		applespi->tp_info.x_min = touchpad_dimensions[0];
+		applespi->tp_info.x_max = touchpad_dimensions[1];
+		applespi->tp_info.y_min = touchpad_dimensions[2];
+		applespi->tp_info.y_max = touchpad_dimensions[3];
+	} else {
+		touchpad_dimensions[0] = applespi->tp_info.x_min;
+		touchpad_dimensions[1] = applespi->tp_info.x_max;
+		touchpad_dimensions[2] = applespi->tp_info.y_min;
+		touchpad_dimensions[3] = applespi->tp_info.y_max;
 	}
 
-	packet = (struct spi_packet *)applespi->rx_buffer;
+	/* set up the input device */
+	touchpad_input_dev = devm_input_allocate_device(&applespi->spi->dev);
 
-	applespi_debug_print_read_packet(applespi, packet);
+	if (!touchpad_input_dev)
+		return -ENOMEM;
 
-	off = le16_to_cpu(packet->offset);
-	rem = le16_to_cpu(packet->remaining);
-	len = le16_to_cpu(packet->length);
+	touchpad_input_dev->name = "Apple SPI Touchpad";
+	touchpad_input_dev->phys = "applespi/input1";
+	touchpad_input_dev->dev.parent = &applespi->spi->dev;
+	touchpad_input_dev->id.bustype = BUS_SPI;
 
-	if (len > sizeof(packet->data)) {
-		dev_warn_ratelimited(&applespi->spi->dev,
-				     "Received corrupted packet (invalid packet length)\n");
-		goto cleanup;
-	}
+	input_set_capability(touchpad_input_dev, EV_REL, REL_X);
+	input_set_capability(touchpad_input_dev, EV_REL, REL_Y);
 
-	/* handle multi-packet messages */
-	if (rem > 0 || off > 0) {
-		if (off != applespi->saved_msg_len) {
-			dev_warn_ratelimited(&applespi->spi->dev,
-					     "Received unexpected offset (got %u, expected %u)\n",
-					     off, applespi->saved_msg_len);
-			goto cleanup;
-		}
+	__set_bit(INPUT_PROP_POINTER, touchpad_input_dev->propbit);
+	__set_bit(INPUT_PROP_BUTTONPAD, touchpad_input_dev->propbit);
 
-		if (off + rem > MAX_PKTS_PER_MSG * APPLESPI_PACKET_SIZE) {
-			dev_warn_ratelimited(&applespi->spi->dev,
-					     "Received message too large (size %u)\n",
-					     off + rem);
-			goto cleanup;
-		}
+	/* finger touch area */
+	input_set_abs_params(touchpad_input_dev, ABS_MT_TOUCH_MAJOR,
+			     0, 2048, 0, 0);
+	input_set_abs_params(touchpad_input_dev, ABS_MT_TOUCH_MINOR,
+			     0, 2048, 0, 0);
 
-		if (off + len > MAX_PKTS_PER_MSG * APPLESPI_PACKET_SIZE) {
-			dev_warn_ratelimited(&applespi->spi->dev,
-					     "Received message too large (size %u)\n",
-					     off + len);
-			goto cleanup;
-		}
+	/* finger approach area */
+	input_set_abs_params(touchpad_input_dev, ABS_MT_WIDTH_MAJOR,
+			     0, 2048, 0, 0);
+	input_set_abs_params(touchpad_input_dev, ABS_MT_WIDTH_MINOR,
+			     0, 2048, 0, 0);
 
-		memcpy(applespi->msg_buf + off, &packet->data, len);
-		applespi->saved_msg_len += len;
+	/* finger orientation */
+	input_set_abs_params(touchpad_input_dev, ABS_MT_ORIENTATION,
+			     -MAX_FINGER_ORIENTATION, MAX_FINGER_ORIENTATION,
+			     0, 0);
 
-		if (rem > 0)
-			return;
+	/* finger pressure */
+	input_set_abs_params(touchpad_input_dev, ABS_MT_PRESSURE,
+			     0, MAX_FINGER_PRESSURE, 0, 0);
 
-		message = (struct message *)applespi->msg_buf;
-		msg_len = applespi->saved_msg_len;
-	} else {
-		message = (struct message *)&packet->data;
-		msg_len = len;
-	}
+	/* finger position */
+	input_set_abs_params(touchpad_input_dev, ABS_MT_POSITION_X,
+			     applespi->tp_info.x_min, applespi->tp_info.x_max,
+			     0, 0);
+	input_set_abs_params(touchpad_input_dev, ABS_MT_POSITION_Y,
+			     applespi->tp_info.y_min, applespi->tp_info.y_max,
+			     0, 0);
 
-	applespi->saved_msg_len = 0;
+	input_set_capability(touchpad_input_dev, EV_KEY,
+			     BTN_TOOL_FINGER);
+	input_set_capability(touchpad_input_dev, EV_KEY, BTN_TOUCH);
+	input_set_capability(touchpad_input_dev, EV_KEY, BTN_LEFT);
+	input_set_capability(touchpad_input_dev, EV_MSC, MSC_TIMESTAMP);
 
-	/* got complete message - verify */
-	if (!applespi_verify_crc(applespi, (u8 *)message, msg_len))
-		goto cleanup;
+	input_mt_init_slots(touchpad_input_dev, MAX_FINGERS,
+			    INPUT_MT_POINTER | INPUT_MT_DROP_UNUSED |
+			    INPUT_MT_TRACK);
 
-	if (le16_to_cpu(message->length) != msg_len - MSG_HEADER_SIZE - 2) {
-		dev_warn_ratelimited(&applespi->spi->dev,
-				     "Received corrupted packet (invalid message length)\n");
-		goto cleanup;
+	result = input_register_device(touchpad_input_dev);
+	if (result) {
+		pr_err("Unabled to register touchpad input device (%d)\n",
+		       result);
+		return -ENODEV;
 	}
 
-	/* handle message */
-	if (packet->flags == PACKET_TYPE_READ &&
-	    packet->device == PACKET_DEV_KEYB) {
-		applespi_handle_keyboard_event(applespi, &message->keyboard);
-
-	} else if (packet->flags == PACKET_TYPE_READ &&
-		   packet->device == PACKET_DEV_TPAD) {
-		struct touchpad_protocol *tp = &message->touchpad;
+	if (tp_scroll) {
+		result = applespi_setup_scroll(applespi);
+		if (result)
+			return result;
+	}
 
-		size_t tp_len = sizeof(*tp) +
-				tp->number_of_fingers * sizeof(tp->fingers[0]);
-		if (le16_to_cpu(message->length) + 2 != tp_len) {
-			dev_warn_ratelimited(&applespi->spi->dev,
-					     "Received corrupted packet (invalid message length)\n");
-			goto cleanup;
-		}
+	if (force_click) {
+		result = applespi_setup_force_click(applespi);
+		if (result)
+			return result;
+	}
 
-		if (tp->number_of_fingers > MAX_FINGERS) {
-			dev_warn_ratelimited(&applespi->spi->dev,
-					     "Number of reported fingers (%u) exceeds max (%u))\n",
-					     tp->number_of_fingers,
-					     MAX_FINGERS);
-			tp->number_of_fingers = MAX_FINGERS;
-		}
+	smp_store_release(&applespi->touchpad_input_dev, touchpad_input_dev);
 
-		report_tp_state(applespi, tp);
+	return 0;
+}
 
-	} else if (packet->flags == PACKET_TYPE_WRITE) {
-		applespi_handle_cmd_response(applespi, packet, message);
-	}
+static void applespi_tp_setup_worker(struct work_struct *work)
+{
+	struct applespi_data *applespi =
+		container_of(work, struct applespi_data, tp_setup_work.work);
+	unsigned long flags;
+	int sts;
 
-cleanup:
-	/*
-	 * Note: this relies on the fact that we are blocking the processing of
-	 * spi messages at this point, i.e. that no further transfers or cs
-	 * changes are processed while we delay here.
-	 */
-	udelay(SPI_RW_CHG_DLY);
+	/* a late response is of no use anymore */
+	spin_lock_irqsave(&applespi->cmd_msg_lock, flags);
+	applespi_detach_cmd(applespi, &applespi->tp_info_cmd);
+	sts = applespi->tp_info_status;
+	spin_unlock_irqrestore(&applespi->cmd_msg_lock, flags);
 
-	/* clean up */
-	applespi_msg_complete(applespi, packet->flags == PACKET_TYPE_WRITE,
-			      true);
+	sts = applespi_setup_touchpad(applespi, sts);
+	if (sts)
+		pr_err("Failed to set up touchpad (%d)\n", sts);
 }
 
-static void applespi_async_read_complete(void *context)
+/*
+ * Wait for the outstanding writes, and if @reads also the outstanding reads,
+ * to finish. Must be called with cmd_msg_lock held and drain set.
+ *
+ * The watchdog normally ends any write the device doesn't respond to, but it
+ * may be disabled, and it can't take back transfers the spi core never
+ * completes. So rather than blocking suspend or remove forever, give up after
+ * DRAIN_TIMEOUT and reset the state; any response still turning up after that
+ * is dropped as stale.
+ */
+static void applespi_wait_drained(struct applespi_data *applespi, bool reads)
 {
-	struct applespi_data *applespi = context;
+	long left;
+
+	left = wait_event_lock_irq_timeout(applespi->drain_complete,
+					   !applespi->write_active &&
+					   !(reads && applespi->read_active),
+					   applespi->cmd_msg_lock,
+					   msecs_to_jiffies(DRAIN_TIMEOUT));
+	if (left)
+		return;
 
-	if (applespi->rd_m.status < 0)
-		pr_warn("Error reading from device: %d\n",
-			applespi->rd_m.status);
-	else
-		applespi_got_data(applespi);
+	dev_warn(&applespi->spi->dev,
+		 "Timed out waiting for %s to finish - resetting\n",
+		 applespi->write_active ? "write" : "read");
+	applespi->drain_timeouts++;
 
-	acpi_finish_gpe(NULL, applespi->gpe);
+	applespi->cmd_msg_queued = false;
+	applespi->write_active = false;
+	applespi->write_txfr_active = false;
+	if (reads) {
+		applespi->read_active = false;
+		applespi->saved_msg_len = 0;
+	}
 }
 
-static u32 applespi_notify(acpi_handle gpe_device, u32 gpe, void *context)
+/*
+ * Wait for all outstanding reads and writes to finish, and fail any queued
+ * commands. Only used when probing fails, once the GPE has been disabled.
+ */
+static void applespi_drain(struct applespi_data *applespi)
 {
-	struct applespi_data *applespi = context;
-	int sts;
 	unsigned long flags;
 
-	debug_print(DBG_RD_IRQ, "--- %s ---------------------------\n",
-		    applespi_debug_facility(DBG_RD_IRQ));
-
 	spin_lock_irqsave(&applespi->cmd_msg_lock, flags);
 
-	sts = applespi_async(applespi, &applespi->rd_m,
-			     applespi_async_read_complete);
-	if (sts != 0)
-		pr_warn("Error queueing async read to device: %d\n", sts);
-	else
-		applespi->read_active = true;
+	applespi->drain = true;
+	applespi_wait_drained(applespi, true);
+
+	applespi_complete_cmd(applespi, -ESHUTDOWN, NULL);
+	applespi_flush_cmds(applespi);
 
 	spin_unlock_irqrestore(&applespi->cmd_msg_lock, flags);
+}
 
-	return ACPI_INTERRUPT_HANDLED;
+static void applespi_cancel_timers(struct applespi_data *applespi)
+{
+	hrtimer_cancel(&applespi->watchdog_timer);
+	hrtimer_cancel(&applespi->bl_timer);
+	hrtimer_cancel(&applespi->fade_timer);
+	hrtimer_cancel(&applespi->cmd_timer);
+	hrtimer_cancel(&applespi->debounce_timer);
 }
 
 static int applespi_probe(struct spi_device *spi)
 {
 	struct applespi_data *applespi;
-	int result, i;
+	int result;
 	unsigned long long gpe, usb_status;
 
 	/* check if the USB interface is present and enabled already */
@@ -1551,23 +5105,6 @@ static int applespi_probe(struct spi_device *spi)
 	if (result)
 		return result;
 
-	/* set up touchpad dimensions */
-	applespi->tp_info = *(struct applespi_tp_info *)
-			dmi_first_match(applespi_touchpad_infos)->driver_data;
-
-	if (touchpad_dimensions[0] || touchpad_dimensions[1] ||
-	    touchpad_dimensions[2] || touchpad_dimensions[3]) {
-		applespi->tp_info.x_min = touchpad_dimensions[0];
-		applespi->tp_info.x_max = touchpad_dimensions[1];
-		applespi->tp_info.y_min = touchpad_dimensions[2];
-		applespi->tp_info.y_max = touchpad_dimensions[3];
-	} else {
-		touchpad_dimensions[0] = applespi->tp_info.x_min;
-		touchpad_dimensions[1] = applespi->tp_info.x_max;
-		touchpad_dimensions[2] = applespi->tp_info.y_min;
-		touchpad_dimensions[3] = applespi->tp_info.y_max;
-	}
-
 	/* setup the keyboard input dev */
 	applespi->keyboard_input_dev = devm_input_allocate_device(&spi->dev);
 
@@ -1586,22 +5123,18 @@ static int applespi_probe(struct spi_device *spi)
 	input_set_drvdata(applespi->keyboard_input_dev, applespi);
 	applespi->keyboard_input_dev->event = applespi_event;
 
-	for (i = 0; i < ARRAY_SIZE(applespi_scancodes); i++)
-		if (applespi_scancodes[i])
-			input_set_capability(applespi->keyboard_input_dev,
-					     EV_KEY, applespi_scancodes[i]);
-
-	for (i = 0; i < ARRAY_SIZE(applespi_controlcodes); i++)
-		if (applespi_controlcodes[i])
-			input_set_capability(applespi->keyboard_input_dev,
-					     EV_KEY, applespi_controlcodes[i]);
+	/* set up the keycode table and the keymaps derived from it */
+	applespi_init_kbd(applespi);
 
-	for (i = 0; i < ARRAY_SIZE(applespi_fn_codes); i++)
-		if (applespi_fn_codes[i].to)
-			input_set_capability(applespi->keyboard_input_dev,
-					     EV_KEY, applespi_fn_codes[i].to);
+	applespi->keyboard_input_dev->keycode = applespi->keycodes;
+	applespi->keyboard_input_dev->keycodemax = MAX_SCANCODES;
+	applespi->keyboard_input_dev->keycodesize =
+			sizeof(applespi->keycodes[0]);
+	applespi->keyboard_input_dev->getkeycode = applespi_getkeycode;
+	applespi->keyboard_input_dev->setkeycode = applespi_setkeycode;
+	applespi->keyboard_input_dev->dev.groups = applespi_kbd_groups;
 
-	input_set_capability(applespi->keyboard_input_dev, EV_KEY, KEY_FN);
+	applespi_set_keybits(applespi);
 
 	result = input_register_device(applespi->keyboard_input_dev);
 	if (result) {
@@ -1610,64 +5143,6 @@ static int applespi_probe(struct spi_device *spi)
 		return -ENODEV;
 	}
 
-	/* now, set up the touchpad as a separate input device */
-	applespi->touchpad_input_dev = devm_input_allocate_device(&spi->dev);
-
-	if (!applespi->touchpad_input_dev)
-		return -ENOMEM;
-
-	applespi->touchpad_input_dev->name = "Apple SPI Touchpad";
-	applespi->touchpad_input_dev->phys = "applespi/input1";
-	applespi->touchpad_input_dev->dev.parent = &spi->dev;
-	applespi->touchpad_input_dev->id.bustype = BUS_SPI;
-
-	input_set_capability(applespi->touchpad_input_dev, EV_REL, REL_X);
-	input_set_capability(applespi->touchpad_input_dev, EV_REL, REL_Y);
-
-	__set_bit(INPUT_PROP_POINTER, applespi->touchpad_input_dev->propbit);
-	__set_bit(INPUT_PROP_BUTTONPAD, applespi->touchpad_input_dev->propbit);
-
-	/* finger touch area */
-	input_set_abs_params(applespi->touchpad_input_dev, ABS_MT_TOUCH_MAJOR,
-			     0, 2048, 0, 0);
-	input_set_abs_params(applespi->touchpad_input_dev, ABS_MT_TOUCH_MINOR,
-			     0, 2048, 0, 0);
-
-	/* finger approach area */
-	input_set_abs_params(applespi->touchpad_input_dev, ABS_MT_WIDTH_MAJOR,
-			     0, 2048, 0, 0);
-	input_set_abs_params(applespi->touchpad_input_dev, ABS_MT_WIDTH_MINOR,
-			     0, 2048, 0, 0);
-
-	/* finger orientation */
-	input_set_abs_params(applespi->touchpad_input_dev, ABS_MT_ORIENTATION,
-			     -MAX_FINGER_ORIENTATION, MAX_FINGER_ORIENTATION,
-			     0, 0);
-
-	/* finger position */
-	input_set_abs_params(applespi->touchpad_input_dev, ABS_MT_POSITION_X,
-			     applespi->tp_info.x_min, applespi->tp_info.x_max,
-			     0, 0);
-	input_set_abs_params(applespi->touchpad_input_dev, ABS_MT_POSITION_Y,
-			     applespi->tp_info.y_min, applespi->tp_info.y_max,
-			     0, 0);
-
-	input_set_capability(applespi->touchpad_input_dev, EV_KEY,
-			     BTN_TOOL_FINGER);
-	input_set_capability(applespi->touchpad_input_dev, EV_KEY, BTN_TOUCH);
-	input_set_capability(applespi->touchpad_input_dev, EV_KEY, BTN_LEFT);
-
-	input_mt_init_slots(applespi->touchpad_input_dev, MAX_FINGERS,
-			    INPUT_MT_POINTER | INPUT_MT_DROP_UNUSED |
-			    INPUT_MT_TRACK);
-
-	result = input_register_device(applespi->touchpad_input_dev);
-	if (result) {
-		pr_err("Unabled to register touchpad input device (%d)\n",
-		       result);
-		return -ENODEV;
-	}
-
 	/*
 	 * The applespi device doesn't send interrupts normally (as is described
 	 * in its DSDT), but rather seems to use ACPI GPEs.
@@ -1680,23 +5155,35 @@ static int applespi_probe(struct spi_device *spi)
 	}
 	applespi->gpe = (int)gpe;
 
+	/* start the thread the touchpad frames are handed to */
+	result = applespi_tp_thread_start(applespi);
+	if (result) {
+		pr_err("Failed to start touchpad thread (%d)\n", result);
+		return result;
+	}
+
 	result = acpi_install_gpe_handler(NULL, applespi->gpe,
 					  ACPI_GPE_LEVEL_TRIGGERED,
 					  applespi_notify, applespi);
 	if (ACPI_FAILURE(result)) {
 		pr_err("Failed to install GPE handler for GPE %d: %s\n",
 		       applespi->gpe, acpi_format_exception(result));
-		return -ENODEV;
+		result = -ENODEV;
+		goto err_stop_thread;
 	}
 
 	result = acpi_enable_gpe(NULL, applespi->gpe);
 	if (ACPI_FAILURE(result)) {
 		pr_err("Failed to enable GPE handler for GPE %d: %s\n",
 		       applespi->gpe, acpi_format_exception(result));
-		acpi_remove_gpe_handler(NULL, applespi->gpe, applespi_notify);
-		return -ENODEV;
+		result = -ENODEV;
+		goto err_remove_handler;
 	}
 
+	/* now, set up the touchpad as a separate input device */
+	INIT_DELAYED_WORK(&applespi->tp_setup_work, applespi_tp_setup_worker);
+	applespi_query_tp_info(applespi);
+
 	/* switch the touchpad into multitouch mode */
 	applespi_init(applespi);
 
@@ -1704,6 +5191,7 @@ static int applespi_probe(struct spi_device *spi)
 	applespi->backlight_info.name            = "spi::kbd_backlight";
 	applespi->backlight_info.default_trigger = "kbd-backlight";
 	applespi->backlight_info.brightness_set  = applespi_set_bl_level;
+	applespi->backlight_info.groups          = applespi_bl_groups;
 
 	result = devm_led_classdev_register(&spi->dev,
 					    &applespi->backlight_info);
@@ -1713,10 +5201,90 @@ static int applespi_probe(struct spi_device *spi)
 		/* not fatal */
 	}
 
+	/* set up debugfs entries */
+	applespi->debugfs_root = debugfs_create_dir("applespi", NULL);
+
+	debugfs_create_u32("read_timeouts", 0444, applespi->debugfs_root,
+			   &applespi->read_timeouts);
+	debugfs_create_u32("write_timeouts", 0444, applespi->debugfs_root,
+			   &applespi->write_timeouts);
+	debugfs_create_u32("stale_rsps", 0444, applespi->debugfs_root,
+			   &applespi->stale_rsps);
+	debugfs_create_u32("drain_timeouts", 0444, applespi->debugfs_root,
+			   &applespi->drain_timeouts);
+	debugfs_create_u32("cmd_queue_depth", 0444, applespi->debugfs_root,
+			   &applespi->cmd_queue_depth);
+	debugfs_create_u32("cmd_queue_max_depth", 0444,
+			   applespi->debugfs_root,
+			   &applespi->cmd_queue_max_depth);
+	debugfs_create_u32("cmds_sent", 0444, applespi->debugfs_root,
+			   &applespi->cmds_sent);
+	debugfs_create_u64("cmd_wait_total_us", 0444, applespi->debugfs_root,
+			   &applespi->cmd_wait_total_us);
+	debugfs_create_u32("cmd_wait_max_us", 0444, applespi->debugfs_root,
+			   &applespi->cmd_wait_max_us);
+	debugfs_create_u32("bl_requests", 0444, applespi->debugfs_root,
+			   &applespi->bl_requests);
+	debugfs_create_u32("bl_cmds_sent", 0444, applespi->debugfs_root,
+			   &applespi->bl_cmds_sent);
+	debugfs_create_file("cmd_latency", 0444, applespi->debugfs_root,
+			    applespi, &applespi_cmd_latency_fops);
+	debugfs_create_x8("tp_model_no", 0444, applespi->debugfs_root,
+			  &applespi->tp_model_no);
+	debugfs_create_u32("kbd_overflows", 0444, applespi->debugfs_root,
+			   &applespi->kbd_overflows);
+	debugfs_create_u32("kbd_debounced", 0444, applespi->debugfs_root,
+			   &applespi->kbd_debounced);
+	debugfs_create_u32("tp_palms", 0444, applespi->debugfs_root,
+			   &applespi->tp_palms);
+	debugfs_create_u32("tp_dwt_frames", 0444, applespi->debugfs_root,
+			   &applespi->tp_dwt_frames);
+	debugfs_create_u32("tp_force_clicks", 0444, applespi->debugfs_root,
+			   &applespi->tp_force_clicks);
+	debugfs_create_u32("tp_scroll_events", 0444, applespi->debugfs_root,
+			   &applespi->tp_scroll_events);
+	debugfs_create_u32("tp_track_by_order", 0444, applespi->debugfs_root,
+			   &applespi->tp_track_by_order);
+	debugfs_create_u32("tp_track_by_pos", 0444, applespi->debugfs_root,
+			   &applespi->tp_track_by_pos);
+	debugfs_create_file("frame_stats", 0444, applespi->debugfs_root,
+			    applespi, &applespi_frame_stats_fops);
+	debugfs_create_u32("tp_ring_overflows", 0444, applespi->debugfs_root,
+			   &applespi->tp_ring_overflows);
+	debugfs_create_file("tp_delay", 0444, applespi->debugfs_root,
+			    applespi, &applespi_tp_delay_fops);
+#ifdef CONFIG_APPLESPI_SELFTEST
+	debugfs_create_file("cmd_build_bench", 0400, applespi->debugfs_root,
+			    applespi, &applespi_cmd_build_bench_fops);
+	debugfs_create_file("keymap_bench", 0400, applespi->debugfs_root,
+			    applespi, &applespi_keymap_bench_fops);
+	debugfs_create_file("kbd_fuzz", 0400, applespi->debugfs_root,
+			    applespi, &applespi_kbd_fuzz_fops);
+	debugfs_create_file("tp_track_bench", 0400, applespi->debugfs_root,
+			    applespi, &applespi_tp_track_bench_fops);
+	debugfs_create_file("tp_decode_bench", 0400, applespi->debugfs_root,
+			    applespi, &applespi_tp_decode_bench_fops);
+#endif
+
+	/* set up the raw packet device */
+	result = applespi_raw_create(applespi);
+	if (result) {
+		pr_err("Unable to register raw packet device (%d)\n", result);
+		/* not fatal */
+	}
+
 	/* done */
 	pr_info("spi-device probe done: %s\n", dev_name(&spi->dev));
 
 	return 0;
+
+err_remove_handler:
+	acpi_remove_gpe_handler(NULL, applespi->gpe, applespi_notify);
+	applespi_drain(applespi);
+err_stop_thread:
+	applespi_tp_thread_stop(applespi);
+	applespi_cancel_timers(applespi);
+	return result;
 }
 
 static int applespi_remove(struct spi_device *spi)
@@ -1728,11 +5296,16 @@ static int applespi_remove(struct spi_device *spi)
 	spin_lock_irqsave(&applespi->cmd_msg_lock, flags);
 
 	applespi->drain = true;
-	wait_event_lock_irq(applespi->drain_complete, !applespi->write_active,
-			    applespi->cmd_msg_lock);
+	applespi_wait_drained(applespi, false);
+
+	applespi_complete_cmd(applespi, -ESHUTDOWN, NULL);
+	applespi_flush_cmds(applespi);
 
 	spin_unlock_irqrestore(&applespi->cmd_msg_lock, flags);
 
+	/* with drain set the touchpad info can't reschedule this anymore */
+	cancel_delayed_work_sync(&applespi->tp_setup_work);
+
 	/* shut things down */
 	acpi_disable_gpe(NULL, applespi->gpe);
 	acpi_remove_gpe_handler(NULL, applespi->gpe, applespi_notify);
@@ -1740,11 +5313,18 @@ static int applespi_remove(struct spi_device *spi)
 	/* wait for all outstanding reads to finish */
 	spin_lock_irqsave(&applespi->cmd_msg_lock, flags);
 
-	wait_event_lock_irq(applespi->drain_complete, !applespi->read_active,
-			    applespi->cmd_msg_lock);
+	applespi_wait_drained(applespi, true);
 
 	spin_unlock_irqrestore(&applespi->cmd_msg_lock, flags);
 
+	applespi_tp_thread_stop(applespi);
+
+	applespi_cancel_timers(applespi);
+
+	debugfs_remove_recursive(applespi->debugfs_root);
+
+	applespi_raw_destroy(applespi);
+
 	/* done */
 	pr_info("spi-device remove done: %s\n", dev_name(&spi->dev));
 	return 0;
@@ -1758,12 +5338,17 @@ static int applespi_suspend(struct device *dev)
 	acpi_status status;
 	unsigned long flags;
 
+	/* don't leave the touchpad set-up pending across suspend */
+	flush_delayed_work(&applespi->tp_setup_work);
+
+	/* let the backlight settle at the end of any fade in progress */
+	applespi_stop_fade(applespi, true);
+
 	/* wait for all outstanding writes to finish */
 	spin_lock_irqsave(&applespi->cmd_msg_lock, flags);
 
 	applespi->drain = true;
-	wait_event_lock_irq(applespi->drain_complete, !applespi->write_active,
-			    applespi->cmd_msg_lock);
+	applespi_wait_drained(applespi, false);
 
 	spin_unlock_irqrestore(&applespi->cmd_msg_lock, flags);
 
@@ -1777,11 +5362,17 @@ static int applespi_suspend(struct device *dev)
 	/* wait for all outstanding reads to finish */
 	spin_lock_irqsave(&applespi->cmd_msg_lock, flags);
 
-	wait_event_lock_irq(applespi->drain_complete, !applespi->read_active,
-			    applespi->cmd_msg_lock);
+	applespi_wait_drained(applespi, true);
 
 	spin_unlock_irqrestore(&applespi->cmd_msg_lock, flags);
 
+	hrtimer_cancel(&applespi->watchdog_timer);
+	hrtimer_cancel(&applespi->bl_timer);
+	hrtimer_cancel(&applespi->cmd_timer);
+
+	/* no more keyboard events till resume */
+	applespi_release_keys(applespi);
+
 	pr_info("spi-device suspend done.\n");
 	return 0;
 }
@@ -1791,14 +5382,15 @@ static int applespi_resume(struct device *dev)
 	struct spi_device *spi = to_spi_device(dev);
 	struct applespi_data *applespi = spi_get_drvdata(spi);
 	acpi_status status;
+	unsigned long flags;
 
 	/* ensure our flags and state reflect a newly resumed device */
 	applespi->drain = false;
-	applespi->have_cl_led_on = false;
-	applespi->have_bl_level = 0;
 	applespi->cmd_msg_queued = false;
+	applespi->cur_cmd = NULL;
 	applespi->read_active = false;
 	applespi->write_active = false;
+	applespi->write_txfr_active = false;
 
 	/* re-enable the interrupt */
 	status = acpi_enable_gpe(NULL, applespi->gpe);
@@ -1813,6 +5405,16 @@ static int applespi_resume(struct device *dev)
 	/* switch the touchpad into multitouch mode */
 	applespi_init(applespi);
 
+	/* restore the caps-lock led and keyboard backlight */
+	spin_lock_irqsave(&applespi->cmd_msg_lock, flags);
+
+	if (applespi->want_cl_led_on)
+		applespi_queue_capsl_cmd(applespi);
+	if (applespi->want_bl_level)
+		applespi_queue_bl_cmd(applespi);
+
+	spin_unlock_irqrestore(&applespi->cmd_msg_lock, flags);
+
 	pr_info("spi-device resume done.\n");
 
 	return 0;